@@ -0,0 +1,78 @@
+#!/bin/sh
+# The same loop run bare and with its body in a try block, which should
+# cost nothing while nothing is raised, and with an error raised every
+# thousandth iteration to show what unwinding to the handler costs. Run
+# from the repository root:
+#   sh bench/exceptions.sh [iterations]
+set -e
+N=${1:-20000000}
+OUT=${TMPDIR:-/tmp}/tvm-exceptions
+mkdir -p "$OUT"
+
+cat > "$OUT/bare.tvm" <<EOF2
+fn run(n) {
+    free total = 0;
+    free j = 0;
+    for (free i = 0; i < n; i++) {
+        j = j + 1;
+        if (j == 1000) {
+            j = 0;
+        }
+        total = total + i;
+    }
+    return total;
+}
+
+run($N)
+EOF2
+
+cat > "$OUT/guarded.tvm" <<EOF2
+fn run(n) {
+    free total = 0;
+    free j = 0;
+    for (free i = 0; i < n; i++) {
+        try {
+            j = j + 1;
+            if (j == 1000) {
+                j = 0;
+            }
+            total = total + i;
+        } catch (e) {
+            total = 0;
+        }
+    }
+    return total;
+}
+
+run($N)
+EOF2
+
+cat > "$OUT/throwing.tvm" <<EOF2
+fn run(n) {
+    free total = 0;
+    free j = 0;
+    for (free i = 0; i < n; i++) {
+        try {
+            j = j + 1;
+            if (j == 1000) {
+                j = 0;
+                error i;
+            }
+            total = total + i;
+        } catch (e) {
+            total = total + e;
+        }
+    }
+    return total;
+}
+
+run($N)
+EOF2
+
+gcc -O2 -o "$OUT/run" bench/run.c
+gcc -O2 -DNDEBUG -o "$OUT/tvm" main.c -lpthread
+
+for script in bare guarded throwing; do
+    printf "%-12s" "$script"
+    "$OUT/run" "$OUT/tvm" "$OUT/$script.tvm"
+done
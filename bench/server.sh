@@ -0,0 +1,143 @@
+#!/bin/sh
+# Throughput and latency of evaluating small expressions on a resident
+# server over a Unix socket, with the compiled-script cache on and off,
+# against starting a process per expression. Run from the repository root:
+#   sh bench/server.sh [requests] [distinct expressions]
+set -e
+N=${1:-20000}
+D=${2:-200}
+OUT=${TMPDIR:-/tmp}/tvm-server
+mkdir -p "$OUT"
+
+# D distinct arithmetic expressions of 40 terms each, requested round-robin.
+awk -v d="$D" 'BEGIN {
+    for (i = 0; i < d; i++) {
+        line = i;
+        for (k = 1; k <= 40; k++) {
+            line = line sprintf(" %s (%d * %d - %d / %d)", k % 2 ? "+" : "-", i, k, k, k + 1);
+        }
+        print line;
+    }
+}' > "$OUT/expressions.txt"
+
+# A client that sends each request once the previous response is in, and
+# reports throughput and latency percentiles.
+cat > "$OUT/client.c" <<'END'
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e6 + time.tv_nsec / 1e3;
+}
+
+static void readFully(int fd, void* buffer, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t count = read(fd, (char*)buffer + done, size - done);
+        if (count <= 0) {
+            fprintf(stderr, "Server closed the connection.\n");
+            exit(1);
+        }
+        done += count;
+    }
+}
+
+static int compare(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// usage: client socket <path> <expressions> <requests>
+//        client fork <tvm> <expressions> <requests>
+int main(int argc, char* argv[]) {
+    char* lines[4096];
+    int count = 0;
+    char buffer[65536];
+    FILE* file = fopen(argv[3], "r");
+    while (count < 4096 && fgets(buffer, sizeof(buffer), file) != NULL) {
+        buffer[strcspn(buffer, "\n")] = '\0';
+        lines[count++] = strdup(buffer);
+    }
+    fclose(file);
+    int requests = atoi(argv[4]);
+    double* latencies = malloc(sizeof(double) * requests);
+    int server = -1;
+    if (strcmp(argv[1], "socket") == 0) {
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strcpy(address.sun_path, argv[2]);
+        server = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(server, (struct sockaddr*)&address, sizeof(address)) < 0) {
+            perror("connect");
+            return 1;
+        }
+    }
+    double start = now();
+    for (int i = 0; i < requests; i++) {
+        const char* source = lines[i % count];
+        uint32_t length = (uint32_t)strlen(source);
+        double sent = now();
+        if (server != -1) {
+            uint8_t header[4] = {length >> 24, length >> 16, length >> 8, length};
+            write(server, header, 4);
+            write(server, source, length);
+            readFully(server, header, 4);
+            uint32_t size = (header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+            readFully(server, buffer, size);
+            if (buffer[0] != 0) {
+                fprintf(stderr, "Request %d failed.\n", i);
+                return 1;
+            }
+        }
+        else {
+            char path[256];
+            snprintf(path, sizeof(path), "%s.tvm", argv[3]);
+            FILE* script = fopen(path, "w");
+            fputs(source, script);
+            fclose(script);
+            pid_t pid = fork();
+            if (pid == 0) {
+                freopen("/dev/null", "w", stdout);
+                execl(argv[2], argv[2], path, (char*)NULL);
+                _exit(127);
+            }
+            int status;
+            waitpid(pid, &status, 0);
+        }
+        latencies[i] = now() - sent;
+    }
+    double elapsed = now() - start;
+    qsort(latencies, requests, sizeof(double), compare);
+    printf("%9.0f req/s  p50 %7.1f us  p99 %7.1f us\n", requests / (elapsed / 1e6),
+            latencies[requests / 2], latencies[requests * 99 / 100]);
+    return 0;
+}
+END
+gcc -O2 -o "$OUT/client" "$OUT/client.c"
+gcc -O2 -DNDEBUG -o "$OUT/tvm-cached" main.c -lpthread
+gcc -O2 -DNDEBUG -DSCRIPT_CACHE_SIZE=0 -o "$OUT/tvm-uncached" main.c -lpthread
+
+for variant in cached uncached; do
+    rm -f "$OUT/tvm.sock"
+    "$OUT/tvm-$variant" --serve "$OUT/tvm.sock" &
+    pid=$!
+    while [ ! -S "$OUT/tvm.sock" ]; do
+        sleep 0.1
+    done
+    printf "%-9s" "$variant"
+    "$OUT/client" socket "$OUT/tvm.sock" "$OUT/expressions.txt" "$N"
+    kill $pid
+    wait $pid 2>/dev/null || true
+done
+printf "%-9s" "fork"
+"$OUT/client" fork "$OUT/tvm-cached" "$OUT/expressions.txt" $((N / 20))
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Startup time and peak resident memory for a script that declares many
+# functions but calls only two of them, with lazy function compilation on
+# and off. Run from the repository root:
+#   sh bench/startup.sh [functions]
+set -e
+N=${1:-5000}
+OUT=${TMPDIR:-/tmp}/tvm-startup
+mkdir -p "$OUT"
+
+i=0
+: > "$OUT/startup.tvm"
+while [ $i -lt "$N" ]; do
+    cat >> "$OUT/startup.tvm" <<EOF
+fn f$i(real a, real b) {
+    real sum = 0;
+    real n = a;
+    while (n < b) {
+        if (n > 10) {
+            sum = sum + n * 2 - 1;
+        }
+        elif (n > 5) {
+            sum = sum - n / 3;
+        }
+        else {
+            sum = sum + 1;
+        }
+        n = n + 1;
+    }
+    return sum + $i;
+}
+EOF
+    i=$((i + 1))
+done
+echo "f0(0, 20) + f$((N - 1))(0, 20)" >> "$OUT/startup.tvm"
+
+gcc -O2 -o "$OUT/run" bench/run.c
+gcc -O2 -DNDEBUG -o "$OUT/tvm-lazy" main.c -lpthread
+gcc -O2 -DNDEBUG -DNO_LAZY_COMPILE -o "$OUT/tvm-eager" main.c -lpthread
+
+for variant in lazy eager; do
+    printf "%-6s" "$variant"
+    "$OUT/run" --rss "$OUT/tvm-$variant" "$OUT/startup.tvm"
+done
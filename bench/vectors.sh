@@ -0,0 +1,69 @@
+#!/bin/sh
+# Element-wise arithmetic and a reduction over vectors of reals, written as
+# interpreted loops over the elements and as whole-vector operations that
+# run in the SIMD kernels, which are also built with -DNO_SIMD for
+# comparison. Both compute the same value. Run from the repository root:
+#   sh bench/vectors.sh [length] [repetitions]
+set -e
+N=${1:-10000}
+R=${2:-200}
+OUT=${TMPDIR:-/tmp}/tvm-vectors
+mkdir -p "$OUT"
+
+# With no collector, every vector result stays allocated: the whole-vector
+# version holds two new vectors per repetition.
+cat > "$OUT/setup.tvm" <<EOF
+fn ramp(n, step) {
+    free v = fill(n, 0);
+    for (free i = 0; i < n; i++) {
+        v[i] = i * step;
+    }
+    return v;
+}
+
+free a = ramp($N, 0.5);
+free b = ramp($N, 0.25);
+EOF
+
+cat "$OUT/setup.tvm" - > "$OUT/loops.tvm" <<EOF
+fn run(a, b, reps) {
+    free n = len(a);
+    free out = fill(n, 0);
+    free total = 0;
+    for (free r = 0; r < reps; r++) {
+        for (free i = 0; i < n; i++) {
+            out[i] = a[i] * 2 + b[i];
+        }
+        for (free i = 0; i < n; i++) {
+            total = total + out[i] * a[i];
+        }
+    }
+    return total;
+}
+
+run(a, b, $R)
+EOF
+
+cat "$OUT/setup.tvm" - > "$OUT/vectors.tvm" <<EOF
+fn run(a, b, reps) {
+    free total = 0;
+    for (free r = 0; r < reps; r++) {
+        total = total + dot(a * 2 + b, a);
+    }
+    return total;
+}
+
+run(a, b, $R)
+EOF
+
+gcc -O2 -o "$OUT/run" bench/run.c
+gcc -O2 -DNDEBUG -o "$OUT/tvm" main.c -lpthread
+gcc -O2 -DNDEBUG -DNO_SIMD -o "$OUT/tvm-nosimd" main.c -lpthread
+
+printf "%-16s%s\n" "result" "$("$OUT/tvm" "$OUT/loops.tvm") $("$OUT/tvm" "$OUT/vectors.tvm")"
+printf "%-16s" "loops"
+"$OUT/run" "$OUT/tvm" "$OUT/loops.tvm"
+printf "%-16s" "vectors"
+"$OUT/run" "$OUT/tvm" "$OUT/vectors.tvm"
+printf "%-16s" "vectors nosimd"
+"$OUT/run" "$OUT/tvm-nosimd" "$OUT/vectors.tvm"
@@ -11,16 +11,147 @@ enum OpCode_ {
     OP_SUB,
     OP_MULT,
     OP_DIV,
-    OP_CONSTANT
+    OP_CONSTANT,
+    OP_NIL,
+    OP_POP,
+    OP_GET_GLOBAL,
+    OP_SET_GLOBAL,
+    OP_TRUE,
+    OP_FALSE,
+    OP_EQUAL,
+    OP_GREATER,
+    OP_LESS,
+    OP_NOT,
+    OP_GET_LOCAL,
+    OP_SET_LOCAL,
+    OP_JUMP,
+    OP_JUMP_IF_FALSE,
+    OP_LOOP,
+    OP_CALL,
+    OP_TAIL_CALL,
+    OP_GET_FIELD,
+    OP_SET_FIELD,
+    OP_JUMP_TABLE,
+    OP_JUMP_SEARCH,
+    OP_JUMP_LINEAR,
+    OP_ADD_REAL,
+    OP_SUB_REAL,
+    OP_MULT_REAL,
+    OP_DIV_REAL,
+    OP_NEGATE_REAL,
+    OP_LESS_REAL,
+    OP_GREATER_REAL,
+    OP_EQUAL_REAL,
+    OP_GUARD_REAL,
+    OP_CONSTANT_LONG,
+    // Counted loops: an increment of a local in place, a less-than test
+    // fused with the branch that exits the loop, and a back-edge that
+    // repeats the loop while one local is less than another.
+    OP_INCR_LOCAL,
+    OP_LESS_JUMP_IF_FALSE,
+    OP_LOOP_LT,
+    // Vectors: a literal built from its operand's count of elements on the
+    // stack, and reading and writing one element.
+    OP_VECTOR,
+    OP_GET_INDEX,
+    OP_SET_INDEX,
+    // Raises the value on top of the stack as an error.
+    OP_THROW,
+    // Emitted only into optimized chunks. The fused arithmetic forms carry
+    // the operator as an operand and speculate that their inputs are
+    // numbers, deoptimizing to the baseline chunk when they aren't.
+    OP_BINARY_LL,
+    OP_BINARY_LK,
+    OP_BINARY_GG,
+    OP_BINARY_GK,
+    OP_SET_LOCAL_POP,
+    OP_SET_GLOBAL_POP,
+    OP_JUMP_IF_FALSE_POP,
+    OP_JUMP_BACK
 };
 typedef enum OpCode_ OpCode;
 
+#define INLINE_CACHE_WAYS 4
+
+struct ObjStruct_;
+
+// Per-site cache for OP_GET_FIELD/OP_SET_FIELD: the shapes seen at the site
+// and where the field lives in each. One entry is monomorphic, up to
+// INLINE_CACHE_WAYS is polymorphic; past that the site keeps missing.
+struct InlineCache_ {
+    uint16_t symbol;
+    int count;
+    struct ObjStruct_* shapes[INLINE_CACHE_WAYS];
+    int indexes[INLINE_CACHE_WAYS];
+};
+typedef struct InlineCache_ InlineCache;
+
+// Dispatch table for a compiled match. Targets are absolute code offsets.
+// OP_JUMP_TABLE indexes targets directly by (subject - min); OP_JUMP_SEARCH
+// binary-searches keys sorted ascending; OP_JUMP_LINEAR compares each key.
+struct JumpTable_ {
+    int count;
+    double min;
+    Value* keys;
+    int* targets;
+    int defaultTarget;
+};
+typedef struct JumpTable_ JumpTable;
+
+// Back-edge counter for one OP_LOOP or OP_LOOP_LT. header is the offset it
+// jumps to.
+struct Loop_ {
+    int header;
+    int hotness;
+};
+typedef struct Loop_ Loop;
+
+// Exception table entry for a try block: an error raised by code in
+// [start, end) is caught by the handler at target, with the frame's stack
+// cut back to depth slots and the error pushed. Inner try blocks come
+// before the blocks around them, so the first entry that covers an
+// offset is the one that catches there.
+struct Handler_ {
+    int start;
+    int end;
+    int target;
+    int depth;
+};
+typedef struct Handler_ Handler;
+
+// Baseline chunks count back-edges per loop and, once one gets hot, point
+// to their optimized version. An optimized chunk points back to its
+// baseline: entries maps baseline offsets to optimized ones for on-stack
+// replacement at a loop header, and resume maps optimized offsets back for
+// deoptimization. unstable marks baseline offsets whose speculation
+// failed, so reoptimizing leaves them alone. Only chunks the verifier has
+// passed are run; maxStack is the deepest their frame's stack gets.
 struct Chunk_ {
     int count;
     int capacity;
     uint8_t* code;
     int* lines;
     ValueArray* constants;
+    int cacheCount;
+    int cacheCapacity;
+    InlineCache* caches;
+    int tableCount;
+    int tableCapacity;
+    JumpTable* tables;
+    int loopCount;
+    int loopCapacity;
+    Loop* loops;
+    int handlerCount;
+    int handlerCapacity;
+    Handler* handlers;
+    struct Chunk_* optimized;
+    struct Chunk_* baseline;
+    int* entries;
+    int* resume;
+    bool* unstable;
+    int deopts;
+    bool verified;
+    int maxStack;
 };
 typedef struct Chunk_ Chunk;
 
@@ -28,6 +159,11 @@ Chunk* initChunk();
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 void freeChunk(Chunk* chunk);
 int addConstant(Chunk* chunk, Value value);
+int addInlineCache(Chunk* chunk, uint16_t symbol);
+int addJumpTable(Chunk* chunk);
+int addLoop(Chunk* chunk, int header);
+void addHandler(Chunk* chunk, int start, int end, int target, int depth);
+int instructionSize(uint8_t instruction);
 
 Chunk* initChunk() {
     Chunk* chunk = malloc(sizeof(Chunk));
@@ -36,6 +172,26 @@ Chunk* initChunk() {
     chunk->code = NULL;
     chunk->lines = NULL;
     chunk->constants = initValueArray();
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;
+    chunk->tableCount = 0;
+    chunk->tableCapacity = 0;
+    chunk->tables = NULL;
+    chunk->loopCount = 0;
+    chunk->loopCapacity = 0;
+    chunk->loops = NULL;
+    chunk->handlerCount = 0;
+    chunk->handlerCapacity = 0;
+    chunk->handlers = NULL;
+    chunk->optimized = NULL;
+    chunk->baseline = NULL;
+    chunk->entries = NULL;
+    chunk->resume = NULL;
+    chunk->unstable = NULL;
+    chunk->deopts = 0;
+    chunk->verified = false;
+    chunk->maxStack = 0;
     return chunk;
 }
 
@@ -58,11 +214,132 @@ int addConstant(Chunk* chunk, Value value) {
     return chunk->constants->count - 1;
 }
 
+int addInlineCache(Chunk* chunk, uint16_t symbol) {
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = grow_capacity(oldCapacity);
+        chunk->caches = grow_array(chunk->caches, InlineCache, oldCapacity,
+                chunk->cacheCapacity);
+    }
+    InlineCache* cache = &chunk->caches[chunk->cacheCount];
+    cache->symbol = symbol;
+    cache->count = 0;
+    return chunk->cacheCount++;
+}
+
+int addJumpTable(Chunk* chunk) {
+    if (chunk->tableCapacity < chunk->tableCount + 1) {
+        int oldCapacity = chunk->tableCapacity;
+        chunk->tableCapacity = grow_capacity(oldCapacity);
+        chunk->tables = grow_array(chunk->tables, JumpTable, oldCapacity,
+                chunk->tableCapacity);
+    }
+    JumpTable* table = &chunk->tables[chunk->tableCount];
+    table->count = 0;
+    table->min = 0;
+    table->keys = NULL;
+    table->targets = NULL;
+    table->defaultTarget = 0;
+    return chunk->tableCount++;
+}
+
+int addLoop(Chunk* chunk, int header) {
+    if (chunk->loopCapacity < chunk->loopCount + 1) {
+        int oldCapacity = chunk->loopCapacity;
+        chunk->loopCapacity = grow_capacity(oldCapacity);
+        chunk->loops = grow_array(chunk->loops, Loop, oldCapacity,
+                chunk->loopCapacity);
+    }
+    Loop* loop = &chunk->loops[chunk->loopCount];
+    loop->header = header;
+    loop->hotness = 0;
+    return chunk->loopCount++;
+}
+
+void addHandler(Chunk* chunk, int start, int end, int target, int depth) {
+    if (chunk->handlerCapacity < chunk->handlerCount + 1) {
+        int oldCapacity = chunk->handlerCapacity;
+        chunk->handlerCapacity = grow_capacity(oldCapacity);
+        chunk->handlers = grow_array(chunk->handlers, Handler, oldCapacity,
+                chunk->handlerCapacity);
+    }
+    Handler* handler = &chunk->handlers[chunk->handlerCount++];
+    handler->start = start;
+    handler->end = end;
+    handler->target = target;
+    handler->depth = depth;
+}
+
+// Size in bytes of an instruction including its operands; used by passes
+// that walk code without executing it.
+int instructionSize(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_SET_LOCAL_POP:
+        case OP_VECTOR:
+            return 2;
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_GET_FIELD:
+        case OP_SET_FIELD:
+        case OP_JUMP_TABLE:
+        case OP_JUMP_SEARCH:
+        case OP_JUMP_LINEAR:
+        case OP_CONSTANT_LONG:
+        case OP_SET_GLOBAL_POP:
+        case OP_JUMP_IF_FALSE_POP:
+        case OP_JUMP_BACK:
+        case OP_INCR_LOCAL:
+        case OP_LESS_JUMP_IF_FALSE:
+            return 3;
+        case OP_BINARY_LL:
+            return 4;
+        case OP_LOOP:
+        case OP_BINARY_LK:
+            return 5;
+        case OP_BINARY_GG:
+        case OP_BINARY_GK:
+            return 6;
+        case OP_LOOP_LT:
+            return 7;
+        default:
+            return 1;
+    }
+}
+
+// An optimized chunk shares its baseline's constants, inline caches and
+// match keys, so only the baseline frees those. A baseline owns its
+// optimized chunk.
 void freeChunk(Chunk* chunk) {
+    bool optimized = chunk->baseline != NULL;
+    if (chunk->optimized != NULL) {
+        freeChunk(chunk->optimized);
+    }
     free_array(uint8_t, chunk->code, chunk->capacity);
     free_array(int, chunk->lines, chunk->capacity);
-    freeValueArray(chunk->constants);
-    chunk = initChunk(chunk);
+    if (!optimized) {
+        freeValueArray(chunk->constants);
+        free_array(InlineCache, chunk->caches, chunk->cacheCapacity);
+    }
+    for (int i = 0; i < chunk->tableCount; i++) {
+        if (!optimized) {
+            free(chunk->tables[i].keys);
+        }
+        free(chunk->tables[i].targets);
+    }
+    free_array(JumpTable, chunk->tables, chunk->tableCapacity);
+    free_array(Loop, chunk->loops, chunk->loopCapacity);
+    free_array(Handler, chunk->handlers, chunk->handlerCapacity);
+    free(chunk->entries);
+    free(chunk->resume);
+    free(chunk->unstable);
+    free(chunk);
 }
 
 #endif
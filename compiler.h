@@ -4,7 +4,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "tokenizer.h"
-#include "vm.h"
+#include "chunk.h"
+#include "debug.h"
+#include "object.h"
+#include "globals.h"
+#include "symbols.h"
+#include "modules.h"
 
 struct Parser_ {
     Token* current;
@@ -14,8 +19,84 @@ struct Parser_ {
 };
 typedef struct Parser_ Parser;
 
+struct Local_ {
+    Token* name;
+    int depth;
+    StaticType type;
+};
+typedef struct Local_ Local;
+
+enum FunctionType_ {
+    TYPE_FUNCTION,
+    TYPE_SCRIPT
+};
+typedef enum FunctionType_ FunctionType;
+
+// One Compiler per function being compiled; the parser, tokenizer, globals,
+// symbols and module cache are shared along the enclosing chain. module is
+// the cached module being compiled, or NULL for a top-level script.
+// lazyFunctions counts the functions a script left to compile on first
+// call, which keep its source alive. lastLess, lastIncrement and
+// lastTarget are the offsets of the latest OP_LESS, local postfix
+// increment and jump target, for fusing them with what follows. tryDepth
+// counts the try blocks around the code being compiled, where a returned
+// call must keep its frame so the handler can still catch its errors.
+struct Compiler_ {
+    struct Compiler_* enclosing;
+    Parser* parser;
+    Tokenizer* tokenizer;
+    Globals* globals;
+    Symbols* symbols;
+    ModuleCache* modules;
+    Module* module;
+    ObjFunction* function;
+    FunctionType type;
+    Local locals[UINT8_COUNT];
+    int localCount;
+    int scopeDepth;
+    int lastCall;
+    int lastLess;
+    int lastIncrement;
+    int lastTarget;
+    StaticType lastType;
+    bool hasResult;
+    int lazyFunctions;
+    int tryDepth;
+};
+typedef struct Compiler_ Compiler;
+
+enum Precedence_ {
+    PREC_NONE,
+    PREC_ASSIGNMENT,
+    PREC_OR,
+    PREC_AND,
+    PREC_EQUALITY,
+    PREC_COMPARISON,
+    PREC_TERM,
+    PREC_FACTOR,
+    PREC_UNARY,
+    PREC_CALL,
+    PREC_PRIMARY
+};
+typedef enum Precedence_ Precedence;
+
+// Below these case counts a linear scan beats a table for match dispatch.
+#define MATCH_TABLE_MIN_CASES 3
+#define MATCH_SEARCH_MIN_CASES 4
+
+typedef void (*ParseFn)(Compiler* compiler, bool canAssign);
+
+struct ParseRule_ {
+    ParseFn prefix;
+    ParseFn infix;
+    Precedence precedence;
+};
+typedef struct ParseRule_ ParseRule;
+
 Parser* initParser() {
     Parser* parser = malloc(sizeof(Parser));
+    parser->current = NULL;
+    parser->previous = NULL;
     parser->hadError = false;
     parser->panicMode = false;
     return parser;
@@ -31,7 +112,7 @@ void errorAt(Parser* parser, Token* token, const char* message) {
         fprintf(stderr, " at end");
     }
     else if (token->type == TOKEN_ERR) {
-        
+
     }
     else {
         fprintf(stderr, " at '%.*s'", token->length, token->start);
@@ -48,7 +129,7 @@ void errorAtCurrent(Parser* parser, const char* message) {
     errorAt(parser, parser->current, message);
 }
 
-void advance(Parser* parser, Tokenizer* tokenizer) {
+void advanceToken(Parser* parser, Tokenizer* tokenizer) {
     parser->previous = parser->current;
     for (;;) {
         parser->current = scanToken(tokenizer);
@@ -61,19 +142,1483 @@ void advance(Parser* parser, Tokenizer* tokenizer) {
 
 void consume(Parser* parser, Tokenizer* tokenizer, TokenType type, const char* message) {
     if (parser->current->type == type) {
-        advance(parser, tokenizer);
+        advanceToken(parser, tokenizer);
         return;
     }
-    errorAtCurrent(message);
+    errorAtCurrent(parser, message);
+}
+
+bool checkToken(Parser* parser, TokenType type) {
+    return parser->current->type == type;
+}
+
+bool matchToken(Parser* parser, Tokenizer* tokenizer, TokenType type) {
+    if (!checkToken(parser, type)) {
+        return false;
+    }
+    advanceToken(parser, tokenizer);
+    return true;
+}
+
+Chunk* currentChunk(Compiler* compiler) {
+    return compiler->function->chunk;
+}
+
+void emitByte(Compiler* compiler, uint8_t byte) {
+    writeChunk(currentChunk(compiler), byte, compiler->parser->previous->line);
+}
+
+void emitBytes(Compiler* compiler, uint8_t byte1, uint8_t byte2) {
+    emitByte(compiler, byte1);
+    emitByte(compiler, byte2);
+}
+
+void emitShort(Compiler* compiler, uint8_t instruction, uint16_t operand) {
+    emitByte(compiler, instruction);
+    emitBytes(compiler, (operand >> 8) & 0xff, operand & 0xff);
+}
+
+int emitJump(Compiler* compiler, uint8_t instruction) {
+    emitShort(compiler, instruction, 0xffff);
+    return currentChunk(compiler)->count - 2;
+}
+
+void patchJump(Compiler* compiler, int offset) {
+    int jump = currentChunk(compiler)->count - offset - 2;
+    if (jump > UINT16_MAX) {
+        error(compiler->parser, "Too much code to jump over.");
+    }
+    currentChunk(compiler)->code[offset] = (jump >> 8) & 0xff;
+    currentChunk(compiler)->code[offset + 1] = jump & 0xff;
+    compiler->lastTarget = currentChunk(compiler)->count;
+}
+
+// Each back-edge gets its own hotness counter, named by the second operand.
+void emitLoop(Compiler* compiler, int loopStart) {
+    int offset = currentChunk(compiler)->count - loopStart + 5;
+    if (offset > UINT16_MAX) {
+        error(compiler->parser, "Loop body too large.");
+    }
+    int loop = addLoop(currentChunk(compiler), loopStart);
+    if (loop > UINT16_MAX) {
+        error(compiler->parser, "Too many loops in one function.");
+    }
+    emitShort(compiler, OP_LOOP, (uint16_t)offset);
+    emitBytes(compiler, (loop >> 8) & 0xff, loop & 0xff);
+}
+
+// The back-edge of a counted loop: jumps to loopStart while the counter
+// local is less than the limit local.
+void emitLoopLess(Compiler* compiler, int counter, int limit, int loopStart) {
+    int offset = currentChunk(compiler)->count - loopStart + 7;
+    if (offset > UINT16_MAX) {
+        error(compiler->parser, "Loop body too large.");
+    }
+    int loop = addLoop(currentChunk(compiler), loopStart);
+    if (loop > UINT16_MAX) {
+        error(compiler->parser, "Too many loops in one function.");
+    }
+    emitBytes(compiler, OP_LOOP_LT, (uint8_t)counter);
+    emitByte(compiler, (uint8_t)limit);
+    emitBytes(compiler, (offset >> 8) & 0xff, offset & 0xff);
+    emitBytes(compiler, (loop >> 8) & 0xff, loop & 0xff);
+}
+
+void emitReturn(Compiler* compiler) {
+    emitBytes(compiler, OP_NIL, OP_RETURN);
+}
+
+int makeConstant(Compiler* compiler, Value value) {
+    int constant = addConstant(currentChunk(compiler), value);
+    if (constant > UINT16_MAX) {
+        error(compiler->parser, "Too many constants in one chunk.");
+        return 0;
+    }
+    return constant;
 }
 
-void compile(Parser* parser, const char* source, Chunk* chunk) {
-    Tokenizer* tokenizer = initTokenizer(source);
+// Large libraries hold more than 256 functions in their top-level chunk,
+// so constants past the first 256 use a 16-bit operand.
+void emitConstant(Compiler* compiler, Value value) {
+    int constant = makeConstant(compiler, value);
+    if (constant <= UINT8_MAX) {
+        emitBytes(compiler, OP_CONSTANT, (uint8_t)constant);
+    }
+    else {
+        emitShort(compiler, OP_CONSTANT_LONG, (uint16_t)constant);
+    }
+}
+
+Compiler* initCompiler(Compiler* enclosing, Parser* parser, Tokenizer* tokenizer,
+        Globals* globals, Symbols* symbols, FunctionType type) {
+    Compiler* compiler = malloc(sizeof(Compiler));
+    compiler->enclosing = enclosing;
+    compiler->parser = parser;
+    compiler->tokenizer = tokenizer;
+    compiler->globals = globals;
+    compiler->symbols = symbols;
+    compiler->modules = enclosing != NULL ? enclosing->modules : NULL;
+    compiler->module = enclosing != NULL ? enclosing->module : NULL;
+    compiler->function = newFunction();
+    compiler->type = type;
+    compiler->localCount = 0;
+    compiler->scopeDepth = 0;
+    compiler->lastCall = -1;
+    compiler->lastLess = -1;
+    compiler->lastIncrement = -1;
+    compiler->lastTarget = -1;
+    compiler->lastType = STATIC_ANY;
+    compiler->hasResult = false;
+    compiler->lazyFunctions = 0;
+    compiler->tryDepth = 0;
+    if (type != TYPE_SCRIPT) {
+        compiler->function->name = copyName(parser->previous->start, parser->previous->length);
+    }
+    // Slot zero of every frame holds the callee.
+    Local* local = &compiler->locals[compiler->localCount++];
+    local->depth = 0;
+    local->name = NULL;
+    local->type = STATIC_ANY;
+    return compiler;
+}
+
+ObjFunction* endCompiler(Compiler* compiler) {
+    if (compiler->type == TYPE_SCRIPT && !compiler->hasResult) {
+        emitByte(compiler, OP_NIL);
+    }
+    if (compiler->type == TYPE_SCRIPT) {
+        emitByte(compiler, OP_RETURN);
+    }
+    else {
+        emitReturn(compiler);
+    }
+    ObjFunction* function = compiler->function;
+#ifdef DEBUG_PRINT_CODE
+    if (!compiler->parser->hadError) {
+        disassembleChunk(currentChunk(compiler), function->name != NULL ? function->name : "<script>");
+    }
+#endif
+    free(compiler);
+    return function;
+}
+
+void expression(Compiler* compiler);
+void statement(Compiler* compiler);
+void declaration(Compiler* compiler);
+ParseRule* getRule(TokenType type);
+void parsePrecedence(Compiler* compiler, Precedence precedence);
+
+void numeric(Compiler* compiler, bool canAssign) {
+    double value = strtod(compiler->parser->previous->start, NULL);
+    emitConstant(compiler, NUMBER_VAL(value));
+    compiler->lastType = STATIC_REAL;
+}
+
+void literal(Compiler* compiler, bool canAssign) {
+    Token* token = compiler->parser->previous;
+    switch (token->type) {
+        case TOKEN_NIL: emitByte(compiler, OP_NIL); break;
+        case TOKEN_BOOLEAN: emitByte(compiler, token->start[0] == 't' ? OP_TRUE : OP_FALSE); break;
+        default: return;
+    }
+}
+
+void stringLiteral(Compiler* compiler, bool canAssign) {
+    Token* token = compiler->parser->previous;
+    emitConstant(compiler, OBJ_VAL(copyString(token->start + 1, token->length - 2)));
+}
+
+void grouping(Compiler* compiler, bool canAssign) {
+    expression(compiler);
+    consume(compiler->parser, compiler->tokenizer, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+}
+
+void unary(Compiler* compiler, bool canAssign) {
+    TokenType operatorType = compiler->parser->previous->type;
+    parsePrecedence(compiler, PREC_UNARY);
+    bool real = compiler->lastType == STATIC_REAL;
+    switch (operatorType) {
+        case TOKEN_MINUS:
+            emitByte(compiler, real ? OP_NEGATE_REAL : OP_NEGATE);
+            compiler->lastType = real ? STATIC_REAL : STATIC_ANY;
+            break;
+        case TOKEN_NOT:
+            emitByte(compiler, OP_NOT);
+            compiler->lastType = STATIC_ANY;
+            break;
+        default: return;
+    }
+}
+
+void binary(Compiler* compiler, bool canAssign) {
+    TokenType operatorType = compiler->parser->previous->type;
+    StaticType leftType = compiler->lastType;
+    ParseRule* rule = getRule(operatorType);
+    parsePrecedence(compiler, (Precedence)(rule->precedence + 1));
+    // With both operands proven real the tag checks can be skipped.
+    bool real = leftType == STATIC_REAL && compiler->lastType == STATIC_REAL;
+    compiler->lastType = STATIC_ANY;
+    switch (operatorType) {
+        case TOKEN_PLUS: emitByte(compiler, real ? OP_ADD_REAL : OP_ADD); break;
+        case TOKEN_MINUS: emitByte(compiler, real ? OP_SUB_REAL : OP_SUB); break;
+        case TOKEN_STAR: emitByte(compiler, real ? OP_MULT_REAL : OP_MULT); break;
+        case TOKEN_SLASH: emitByte(compiler, real ? OP_DIV_REAL : OP_DIV); break;
+        case TOKEN_EQ: emitByte(compiler, real ? OP_EQUAL_REAL : OP_EQUAL); return;
+        case TOKEN_NOT_EQ: emitBytes(compiler, real ? OP_EQUAL_REAL : OP_EQUAL, OP_NOT); return;
+        case TOKEN_GREATER: emitByte(compiler, real ? OP_GREATER_REAL : OP_GREATER); return;
+        case TOKEN_GREATER_EQ: emitBytes(compiler, real ? OP_LESS_REAL : OP_LESS, OP_NOT); return;
+        case TOKEN_LESS:
+            compiler->lastLess = currentChunk(compiler)->count;
+            emitByte(compiler, real ? OP_LESS_REAL : OP_LESS);
+            return;
+        case TOKEN_LESS_EQ: emitBytes(compiler, real ? OP_GREATER_REAL : OP_GREATER, OP_NOT); return;
+        default: return;
+    }
+    // Arithmetic on reals yields a real; with any other operand it may
+    // yield a vector.
+    compiler->lastType = real ? STATIC_REAL : STATIC_ANY;
+}
+
+void and_(Compiler* compiler, bool canAssign) {
+    int endJump = emitJump(compiler, OP_JUMP_IF_FALSE);
+    emitByte(compiler, OP_POP);
+    parsePrecedence(compiler, PREC_AND);
+    patchJump(compiler, endJump);
+    compiler->lastType = STATIC_ANY;
+}
+
+void or_(Compiler* compiler, bool canAssign) {
+    int elseJump = emitJump(compiler, OP_JUMP_IF_FALSE);
+    int endJump = emitJump(compiler, OP_JUMP);
+    patchJump(compiler, elseJump);
+    emitByte(compiler, OP_POP);
+    parsePrecedence(compiler, PREC_OR);
+    patchJump(compiler, endJump);
+    compiler->lastType = STATIC_ANY;
+}
+
+uint8_t argumentList(Compiler* compiler) {
+    uint8_t argCount = 0;
+    if (!checkToken(compiler->parser, TOKEN_RIGHT_PAREN)) {
+        do {
+            expression(compiler);
+            if (argCount == 255) {
+                error(compiler->parser, "Can't have more than 255 arguments.");
+            }
+            argCount++;
+        } while (matchToken(compiler->parser, compiler->tokenizer, TOKEN_COMMA));
+    }
+    consume(compiler->parser, compiler->tokenizer, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    return argCount;
+}
+
+void call(Compiler* compiler, bool canAssign) {
+    uint8_t argCount = argumentList(compiler);
+    emitBytes(compiler, OP_CALL, argCount);
+    compiler->lastCall = currentChunk(compiler)->count - 2;
+    compiler->lastType = STATIC_ANY;
+}
+
+// A vector literal: its elements are checked to be numbers as it's built.
+void vectorLiteral(Compiler* compiler, bool canAssign) {
+    Parser* parser = compiler->parser;
+    int count = 0;
+    if (!checkToken(parser, TOKEN_RIGHT_SQ)) {
+        do {
+            expression(compiler);
+            if (count == 255) {
+                error(parser, "Can't have more than 255 elements in a vector literal.");
+            }
+            count++;
+        } while (matchToken(parser, compiler->tokenizer, TOKEN_COMMA));
+    }
+    consume(parser, compiler->tokenizer, TOKEN_RIGHT_SQ, "Expect ']' after vector elements.");
+    emitBytes(compiler, OP_VECTOR, (uint8_t)count);
+    compiler->lastType = STATIC_ANY;
+}
+
+// Indexing yields a number or fails, as does storing anything else.
+void subscript(Compiler* compiler, bool canAssign) {
+    Parser* parser = compiler->parser;
+    expression(compiler);
+    consume(parser, compiler->tokenizer, TOKEN_RIGHT_SQ, "Expect ']' after index.");
+    if (canAssign && matchToken(parser, compiler->tokenizer, TOKEN_ASSIGN)) {
+        expression(compiler);
+        emitByte(compiler, OP_SET_INDEX);
+    }
+    else {
+        emitByte(compiler, OP_GET_INDEX);
+    }
+    compiler->lastType = STATIC_REAL;
+}
+
+uint16_t fieldSymbol(Compiler* compiler, Token* name) {
+    int symbol = internSymbol(compiler->symbols, name->start, name->length);
+    if (symbol == -1) {
+        error(compiler->parser, "Too many field names.");
+        return 0;
+    }
+    return (uint16_t)symbol;
+}
+
+// Each field access site gets its own inline cache in the chunk; the
+// instruction operand is the cache index.
+void dot(Compiler* compiler, bool canAssign) {
+    consume(compiler->parser, compiler->tokenizer, TOKEN_ID, "Expect field name after '.'.");
+    uint16_t symbol = fieldSymbol(compiler, compiler->parser->previous);
+    int cache = addInlineCache(currentChunk(compiler), symbol);
+    if (cache > UINT16_MAX) {
+        error(compiler->parser, "Too many field accesses in one chunk.");
+        return;
+    }
+    if (canAssign && matchToken(compiler->parser, compiler->tokenizer, TOKEN_ASSIGN)) {
+        expression(compiler);
+        emitShort(compiler, OP_SET_FIELD, (uint16_t)cache);
+    }
+    else {
+        emitShort(compiler, OP_GET_FIELD, (uint16_t)cache);
+    }
+    compiler->lastType = STATIC_ANY;
+}
+
+bool identifiersEqual(Token* a, Token* b) {
+    return a->length == b->length && memcmp(a->start, b->start, a->length) == 0;
+}
+
+// Locals are addressed by their offset from the frame's base slot.
+int resolveLocal(Compiler* compiler, Token* name) {
+    for (int i = compiler->localCount - 1; i >= 0; i--) {
+        Local* local = &compiler->locals[i];
+        if (local->name != NULL && identifiersEqual(name, local->name)) {
+            if (local->depth == -1) {
+                error(compiler->parser, "Can't read local variable in its own initializer.");
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Globals are resolved here, once, to a dense slot index; the VM never sees
+// the name again.
+int resolveGlobal(Compiler* compiler, Token* name) {
+    int slot = findGlobal(compiler->globals, name->start, name->length);
+    if (slot != -1) {
+        return slot;
+    }
+    if (compiler->globals->count == GLOBALS_MAX) {
+        error(compiler->parser, "Too many global variables.");
+        return 0;
+    }
+    return addGlobal(compiler->globals, name->start, name->length);
+}
+
+// Consumes '.member' after an enum name and returns the member's constant
+// global slot, or -1 after reporting an error.
+int resolveEnumMember(Compiler* compiler, int enumSlot) {
+    Parser* parser = compiler->parser;
+    consume(parser, compiler->tokenizer, TOKEN_DOT, "Expect '.' after enum name.");
+    consume(parser, compiler->tokenizer, TOKEN_ID, "Expect enum member name.");
+    if (parser->hadError) {
+        return -1;
+    }
+    const char* enumName = compiler->globals->names[enumSlot];
+    int enumLength = (int)strlen(enumName);
+    int length = enumLength + 1 + parser->previous->length;
+    char* qualified = malloc(length);
+    memcpy(qualified, enumName, enumLength);
+    qualified[enumLength] = '.';
+    memcpy(qualified + enumLength + 1, parser->previous->start, parser->previous->length);
+    int slot = findGlobal(compiler->globals, qualified, length);
+    free(qualified);
+    if (slot == -1 || compiler->globals->kinds[slot] != GLOBAL_CONSTANT) {
+        error(parser, "Undefined enum member.");
+        return -1;
+    }
+    return slot;
+}
+
+// Keeps a typed variable's invariant when storing a value the compiler
+// could not prove to be of the declared type.
+void emitGuard(Compiler* compiler, StaticType type) {
+    if (type == STATIC_REAL && compiler->lastType != STATIC_REAL) {
+        emitByte(compiler, OP_GUARD_REAL);
+    }
+}
+
+static void emitVariable(Compiler* compiler, uint8_t op, int arg) {
+    if (op == OP_GET_LOCAL || op == OP_SET_LOCAL) {
+        emitBytes(compiler, op, (uint8_t)arg);
+    }
+    else {
+        emitShort(compiler, op, (uint16_t)arg);
+    }
+}
+
+// x++ and x-- evaluate to the old value. A real local is updated in place
+// after its old value is pushed; anything else goes through the stack.
+void postfixIncrement(Compiler* compiler, uint8_t getOp, uint8_t setOp, int arg,
+        StaticType type) {
+    advanceToken(compiler->parser, compiler->tokenizer);
+    bool increment = compiler->parser->previous->type == TOKEN_INCR;
+    compiler->lastType = type;
+#ifndef NO_LOOP_FUSION
+    // OP_INCR_LOCAL only steps numbers, so a local not declared real takes
+    // the generic OP_ADD, which also steps every element of a vector.
+    if (getOp == OP_GET_LOCAL && type == STATIC_REAL) {
+        compiler->lastIncrement = currentChunk(compiler)->count;
+        emitBytes(compiler, OP_GET_LOCAL, (uint8_t)arg);
+        emitBytes(compiler, OP_INCR_LOCAL, (uint8_t)arg);
+        emitByte(compiler, increment ? 1 : (uint8_t)-1);
+        return;
+    }
+#endif
+    emitVariable(compiler, getOp, arg);
+    emitVariable(compiler, getOp, arg);
+    emitConstant(compiler, NUMBER_VAL(1));
+    emitByte(compiler, increment ? OP_ADD : OP_SUB);
+    emitVariable(compiler, setOp, arg);
+    emitByte(compiler, OP_POP);
+}
+
+void namedVariable(Compiler* compiler, Token* name, bool canAssign) {
+    uint8_t getOp, setOp;
+    StaticType type;
+    int arg = resolveLocal(compiler, name);
+    if (arg != -1) {
+        getOp = OP_GET_LOCAL;
+        setOp = OP_SET_LOCAL;
+        type = compiler->locals[arg].type;
+    }
+    else {
+        for (Compiler* outer = compiler->enclosing; outer != NULL; outer = outer->enclosing) {
+            if (resolveLocal(outer, name) != -1) {
+                error(compiler->parser, "Can't capture a local variable of an enclosing function.");
+                return;
+            }
+        }
+        arg = resolveGlobal(compiler, name);
+        if (compiler->globals->kinds[arg] == GLOBAL_ENUM) {
+            int member = resolveEnumMember(compiler, arg);
+            if (member != -1) {
+                emitConstant(compiler, compiler->globals->values[member]);
+                compiler->lastType = STATIC_REAL;
+            }
+            return;
+        }
+        getOp = OP_GET_GLOBAL;
+        setOp = OP_SET_GLOBAL;
+        type = (StaticType)compiler->globals->types[arg];
+        compiler->globals->used[arg] = true;
+    }
+    if (checkToken(compiler->parser, TOKEN_INCR) || checkToken(compiler->parser, TOKEN_DECR)) {
+        postfixIncrement(compiler, getOp, setOp, arg, type);
+        return;
+    }
+    if (canAssign && matchToken(compiler->parser, compiler->tokenizer, TOKEN_ASSIGN)) {
+        expression(compiler);
+        emitGuard(compiler, type);
+        emitVariable(compiler, setOp, arg);
+    }
+    else {
+        emitVariable(compiler, getOp, arg);
+    }
+    compiler->lastType = type;
+}
+
+void variable(Compiler* compiler, bool canAssign) {
+    namedVariable(compiler, compiler->parser->previous, canAssign);
+}
+
+ParseRule rules[] = {
+    [TOKEN_LEFT_PAREN]    = {grouping, call,   PREC_CALL},
+    [TOKEN_LEFT_SQ]       = {vectorLiteral, subscript, PREC_CALL},
+    [TOKEN_DOT]           = {NULL,     dot,    PREC_CALL},
+    [TOKEN_MINUS]         = {unary,    binary, PREC_TERM},
+    [TOKEN_PLUS]          = {NULL,     binary, PREC_TERM},
+    [TOKEN_SLASH]         = {NULL,     binary, PREC_FACTOR},
+    [TOKEN_STAR]          = {NULL,     binary, PREC_FACTOR},
+    [TOKEN_LESS]          = {NULL,     binary, PREC_COMPARISON},
+    [TOKEN_LESS_EQ]       = {NULL,     binary, PREC_COMPARISON},
+    [TOKEN_GREATER]       = {NULL,     binary, PREC_COMPARISON},
+    [TOKEN_GREATER_EQ]    = {NULL,     binary, PREC_COMPARISON},
+    [TOKEN_EQ]            = {NULL,     binary, PREC_EQUALITY},
+    [TOKEN_NOT_EQ]        = {NULL,     binary, PREC_EQUALITY},
+    [TOKEN_AND]           = {NULL,     and_,   PREC_AND},
+    [TOKEN_OR]            = {NULL,     or_,    PREC_OR},
+    [TOKEN_NOT]           = {unary,    NULL,   PREC_NONE},
+    [TOKEN_ID]            = {variable, NULL,   PREC_NONE},
+    [TOKEN_NUMBER]        = {numeric,  NULL,   PREC_NONE},
+    [TOKEN_STRING]        = {stringLiteral, NULL, PREC_NONE},
+    [TOKEN_BOOLEAN]       = {literal,  NULL,   PREC_NONE},
+    [TOKEN_NIL]           = {literal,  NULL,   PREC_NONE},
+    [TOKEN_EOF]           = {NULL,     NULL,   PREC_NONE}
+};
+
+ParseRule* getRule(TokenType type) {
+    return &rules[type];
+}
+
+void parsePrecedence(Compiler* compiler, Precedence precedence) {
+    Parser* parser = compiler->parser;
+    advanceToken(parser, compiler->tokenizer);
+    ParseFn prefixRule = getRule(parser->previous->type)->prefix;
+    if (prefixRule == NULL) {
+        error(parser, "Expect expression.");
+        return;
+    }
+    bool canAssign = precedence <= PREC_ASSIGNMENT;
+    compiler->lastType = STATIC_ANY;
+    prefixRule(compiler, canAssign);
+    while (precedence <= getRule(parser->current->type)->precedence) {
+        advanceToken(parser, compiler->tokenizer);
+        ParseFn infixRule = getRule(parser->previous->type)->infix;
+        infixRule(compiler, canAssign);
+    }
+    if (canAssign && matchToken(parser, compiler->tokenizer, TOKEN_ASSIGN)) {
+        error(parser, "Invalid assignment target.");
+    }
+}
+
+void expression(Compiler* compiler) {
+    parsePrecedence(compiler, PREC_ASSIGNMENT);
+}
+
+void beginScope(Compiler* compiler) {
+    compiler->scopeDepth++;
+}
+
+void endScope(Compiler* compiler) {
+    compiler->scopeDepth--;
+    while (compiler->localCount > 0 &&
+           compiler->locals[compiler->localCount - 1].depth > compiler->scopeDepth) {
+        emitByte(compiler, OP_POP);
+        compiler->localCount--;
+    }
+}
+
+void block(Compiler* compiler) {
+    while (!checkToken(compiler->parser, TOKEN_RIGHT_CURLY) && !checkToken(compiler->parser, TOKEN_EOF)) {
+        declaration(compiler);
+    }
+    consume(compiler->parser, compiler->tokenizer, TOKEN_RIGHT_CURLY, "Expect '}' after block.");
+}
+
+void addLocal(Compiler* compiler, Token* name) {
+    if (compiler->localCount == UINT8_COUNT) {
+        error(compiler->parser, "Too many local variables in function.");
+        return;
+    }
+    Local* local = &compiler->locals[compiler->localCount++];
+    local->name = name;
+    local->depth = -1;
+    local->type = STATIC_ANY;
+}
+
+void declareLocal(Compiler* compiler) {
+    Token* name = compiler->parser->previous;
+    for (int i = compiler->localCount - 1; i >= 0; i--) {
+        Local* local = &compiler->locals[i];
+        if (local->depth != -1 && local->depth < compiler->scopeDepth) {
+            break;
+        }
+        if (local->name != NULL && identifiersEqual(name, local->name)) {
+            error(compiler->parser, "Already a variable with this name in this scope.");
+        }
+    }
+    addLocal(compiler, name);
+}
+
+void markInitialized(Compiler* compiler) {
+    compiler->locals[compiler->localCount - 1].depth = compiler->scopeDepth;
+}
+
+StaticType declaredType(TokenType type) {
+    return type == TOKEN_REAL ? STATIC_REAL : STATIC_ANY;
+}
+
+// Declares the name just consumed. At the top level this yields a global
+// slot; inside a scope the value simply stays in its stack slot. A global
+// keeps its type once compiled code uses it: stores compiled before a
+// real declaration carry no guard, and loads compiled after one skip the
+// type checks.
+int declareVariable(Compiler* compiler, StaticType type) {
+    if (compiler->scopeDepth > 0) {
+        declareLocal(compiler);
+        compiler->locals[compiler->localCount - 1].type = type;
+        return -1;
+    }
+    int global = resolveGlobal(compiler, compiler->parser->previous);
+    Globals* globals = compiler->globals;
+    if (globals->types[global] != type && IS_NATIVE(globals->values[global])) {
+        // A typed global hides the built-in of the same name.
+        globals->values[global] = UNDEFINED_VAL;
+    }
+    if (globals->types[global] != type && !IS_UNDEFINED(globals->values[global])) {
+        error(compiler->parser, "Already a global with this name and a different type.");
+    }
+    else if (globals->types[global] != type && globals->used[global]) {
+        error(compiler->parser, "Can't change the type of a global already used by compiled code.");
+    }
+    globals->types[global] = type;
+    return global;
+}
+
+void defineVariable(Compiler* compiler, int global) {
+    if (compiler->scopeDepth > 0) {
+        markInitialized(compiler);
+        return;
+    }
+    compiler->globals->used[global] = true;
+    emitShort(compiler, OP_SET_GLOBAL, (uint16_t)global);
+    emitByte(compiler, OP_POP);
+}
+
+bool isTypeToken(TokenType type) {
+    switch (type) {
+        case TOKEN_REAL:
+        case TOKEN_CHAR:
+        case TOKEN_BOOL:
+        case TOKEN_VOID:
+        case TOKEN_FREE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+ObjFunction* functionBody(Compiler* compiler, FunctionType type) {
+    Parser* parser = compiler->parser;
+    Compiler* inner = initCompiler(compiler, parser, compiler->tokenizer, compiler->globals,
+            compiler->symbols, type);
+    beginScope(inner);
+    consume(parser, inner->tokenizer, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!checkToken(parser, TOKEN_RIGHT_PAREN)) {
+        do {
+            inner->function->arity++;
+            if (inner->function->arity > 255) {
+                errorAtCurrent(parser, "Can't have more than 255 parameters.");
+            }
+            StaticType type = STATIC_ANY;
+            if (isTypeToken(parser->current->type)) {
+                advanceToken(parser, inner->tokenizer);
+                type = declaredType(parser->previous->type);
+            }
+            consume(parser, inner->tokenizer, TOKEN_ID, "Expect parameter name.");
+            declareLocal(inner);
+            markInitialized(inner);
+            inner->locals[inner->localCount - 1].type = type;
+            if (type != STATIC_ANY && inner->function->arity <= 255) {
+                ObjFunction* function = inner->function;
+                if (function->paramTypes == NULL) {
+                    function->paramTypes = calloc(UINT8_COUNT, sizeof(uint8_t));
+                }
+                function->paramTypes[function->arity - 1] = type;
+            }
+        } while (matchToken(parser, inner->tokenizer, TOKEN_COMMA));
+    }
+    consume(parser, inner->tokenizer, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(parser, inner->tokenizer, TOKEN_LEFT_CURLY, "Expect '{' before function body.");
+    block(inner);
+    return endCompiler(inner);
+}
+
+void compileFunction(Compiler* compiler, FunctionType type) {
+    emitConstant(compiler, OBJ_VAL(functionBody(compiler, type)));
+}
+
+// Top-level functions are only skimmed at load time: the parameter list is
+// stepped over, the body brace-matched, and both are compiled on the first
+// call. Nested functions still compile with their enclosing function, which
+// is what rejects references to its locals.
+void skimFunction(Compiler* compiler) {
+    Parser* parser = compiler->parser;
+    Token* name = parser->previous;
+    consume(parser, compiler->tokenizer, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    while (!checkToken(parser, TOKEN_RIGHT_PAREN) && !checkToken(parser, TOKEN_EOF)) {
+        advanceToken(parser, compiler->tokenizer);
+    }
+    consume(parser, compiler->tokenizer, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    if (!checkToken(parser, TOKEN_LEFT_CURLY)) {
+        errorAtCurrent(parser, "Expect '{' before function body.");
+        return;
+    }
+    if (!skipBlock(compiler->tokenizer)) {
+        errorAtCurrent(parser, "Expect '}' after block.");
+    }
+    advanceToken(parser, compiler->tokenizer);
+    compiler->lazyFunctions++;
+    emitConstant(compiler, OBJ_VAL(newLazyFunction(copyName(name->start, name->length),
+            name->start, name->line)));
+}
+
+// Compiles a skimmed function in place, against the tables of the program
+// it ended up in. Returns false after reporting any compile errors.
+bool compileLazyFunction(ObjFunction* function, Globals* globals, Symbols* symbols,
+        ModuleCache* modules) {
+    Tokenizer* tokenizer = initTokenizer(function->source);
+    tokenizer->line = function->line;
+    Parser* parser = initParser();
+    Compiler* compiler = initCompiler(NULL, parser, tokenizer, globals, symbols, TYPE_SCRIPT);
+    compiler->modules = modules;
+    advanceToken(parser, tokenizer);
+    advanceToken(parser, tokenizer);
+    ObjFunction* compiled = functionBody(compiler, TYPE_FUNCTION);
+    bool hadError = parser->hadError;
+    if (!hadError) {
+        function->arity = compiled->arity;
+        function->paramTypes = compiled->paramTypes;
+        function->chunk = compiled->chunk;
+        function->source = NULL;
+    }
+    else {
+        free(compiled->paramTypes);
+        freeChunk(compiled->chunk);
+    }
+    // The stub keeps its own name; the compiled copy and the script
+    // function wrapped around the body are only scaffolding.
+    free(compiled->name);
+    free(compiled);
+    freeChunk(compiler->function->chunk);
+    free(compiler->function);
+    free(compiler);
+    free(parser);
+    free(tokenizer);
+    return !hadError;
+}
+
+void fnDeclaration(Compiler* compiler) {
+    consume(compiler->parser, compiler->tokenizer, TOKEN_ID, "Expect function name.");
+    int global = declareVariable(compiler, STATIC_ANY);
+    if (compiler->scopeDepth > 0) {
+        markInitialized(compiler);
+    }
+#ifndef NO_LAZY_COMPILE
+    if (compiler->type == TYPE_SCRIPT && compiler->scopeDepth == 0) {
+        skimFunction(compiler);
+        defineVariable(compiler, global);
+        return;
+    }
+#endif
+    compileFunction(compiler, TYPE_FUNCTION);
+    defineVariable(compiler, global);
+}
+
+void structDeclaration(Compiler* compiler) {
+    Parser* parser = compiler->parser;
+    consume(parser, compiler->tokenizer, TOKEN_ID, "Expect struct name.");
+    Token* name = parser->previous;
+    int global = declareVariable(compiler, STATIC_ANY);
+    ObjStruct* shape = newStruct(copyName(name->start, name->length));
+    consume(parser, compiler->tokenizer, TOKEN_LEFT_CURLY, "Expect '{' before struct body.");
+    while (!checkToken(parser, TOKEN_RIGHT_CURLY) && !checkToken(parser, TOKEN_EOF)) {
+        if (isTypeToken(parser->current->type)) {
+            advanceToken(parser, compiler->tokenizer);
+        }
+        consume(parser, compiler->tokenizer, TOKEN_ID, "Expect field name.");
+        uint16_t symbol = fieldSymbol(compiler, parser->previous);
+        if (findField(shape, symbol) != -1) {
+            error(parser, "Already a field with this name in this struct.");
+        }
+        else if (shape->fieldCount == UINT8_MAX) {
+            error(parser, "Too many fields in struct.");
+        }
+        else {
+            addStructField(shape, symbol);
+        }
+        consume(parser, compiler->tokenizer, TOKEN_SEMICOLON, "Expect ';' after field name.");
+        if (parser->panicMode) {
+            break;
+        }
+    }
+    consume(parser, compiler->tokenizer, TOKEN_RIGHT_CURLY, "Expect '}' after struct body.");
+    emitConstant(compiler, OBJ_VAL(shape));
+    defineVariable(compiler, global);
+}
+
+// Enum members are compile-time constants; the declaration emits no code.
+void enumDeclaration(Compiler* compiler) {
+    Parser* parser = compiler->parser;
+    Globals* globals = compiler->globals;
+    consume(parser, compiler->tokenizer, TOKEN_ID, "Expect enum name.");
+    Token* name = parser->previous;
+    int slot = resolveGlobal(compiler, name);
+    if (globals->kinds[slot] != GLOBAL_VARIABLE || !IS_UNDEFINED(globals->values[slot])) {
+        error(parser, "Already a global with this name.");
+        return;
+    }
+    globals->kinds[slot] = GLOBAL_ENUM;
+    globals->values[slot] = NIL_VAL;
+    consume(parser, compiler->tokenizer, TOKEN_LEFT_CURLY, "Expect '{' before enum body.");
+    double next = 0;
+    while (!checkToken(parser, TOKEN_RIGHT_CURLY) && !checkToken(parser, TOKEN_EOF)) {
+        consume(parser, compiler->tokenizer, TOKEN_ID, "Expect enum member name.");
+        Token* member = parser->previous;
+        if (matchToken(parser, compiler->tokenizer, TOKEN_ASSIGN)) {
+            bool negate = matchToken(parser, compiler->tokenizer, TOKEN_MINUS);
+            consume(parser, compiler->tokenizer, TOKEN_NUMBER, "Expect number as enum value.");
+            next = strtod(parser->previous->start, NULL);
+            if (negate) {
+                next = -next;
+            }
+        }
+        int length = name->length + 1 + member->length;
+        char* qualified = malloc(length);
+        memcpy(qualified, name->start, name->length);
+        qualified[name->length] = '.';
+        memcpy(qualified + name->length + 1, member->start, member->length);
+        if (findGlobal(globals, qualified, length) != -1) {
+            errorAt(parser, member, "Already a member with this name in this enum.");
+        }
+        else if (globals->count == GLOBALS_MAX) {
+            error(parser, "Too many global variables.");
+        }
+        else {
+            int memberSlot = addGlobal(globals, qualified, length);
+            globals->kinds[memberSlot] = GLOBAL_CONSTANT;
+            globals->values[memberSlot] = NUMBER_VAL(next);
+        }
+        free(qualified);
+        next++;
+        if (!matchToken(parser, compiler->tokenizer, TOKEN_COMMA)) {
+            break;
+        }
+    }
+    consume(parser, compiler->tokenizer, TOKEN_RIGHT_CURLY, "Expect '}' after enum body.");
+}
+
+void varDeclaration(Compiler* compiler, StaticType type) {
+    consume(compiler->parser, compiler->tokenizer, TOKEN_ID, "Expect variable name.");
+    int global = declareVariable(compiler, type);
+    if (matchToken(compiler->parser, compiler->tokenizer, TOKEN_ASSIGN)) {
+        expression(compiler);
+        emitGuard(compiler, type);
+    }
+    else if (type == STATIC_REAL) {
+        emitConstant(compiler, NUMBER_VAL(0));
+    }
+    else {
+        emitByte(compiler, OP_NIL);
+    }
+    consume(compiler->parser, compiler->tokenizer, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    defineVariable(compiler, global);
+}
+
+// Pops the value of the expression just compiled. Only the in-place update
+// of a local postfix increment is kept, unless something jumps past it.
+void discardResult(Compiler* compiler) {
+    Chunk* chunk = currentChunk(compiler);
+    if (compiler->lastIncrement != -1 && compiler->lastIncrement == chunk->count - 5 &&
+        compiler->lastTarget != chunk->count) {
+        memmove(&chunk->code[chunk->count - 5], &chunk->code[chunk->count - 3], 3);
+        memmove(&chunk->lines[chunk->count - 5], &chunk->lines[chunk->count - 3], 3 * sizeof(int));
+        chunk->count -= 2;
+        compiler->lastIncrement = -1;
+        return;
+    }
+    emitByte(compiler, OP_POP);
+}
+
+// Emits the branch out of a statement once its condition is compiled and
+// returns it for patching. A condition ending in < fuses with the branch,
+// which pops both operands; otherwise the condition stays on the stack and
+// the caller pops it on both paths, as *fused tells.
+int emitConditionJump(Compiler* compiler, bool* fused) {
+    Chunk* chunk = currentChunk(compiler);
+#ifndef NO_LOOP_FUSION
+    if (compiler->lastLess != -1 && compiler->lastLess == chunk->count - 1 &&
+        compiler->lastTarget != chunk->count) {
+        chunk->count--;
+        compiler->lastLess = -1;
+        *fused = true;
+        return emitJump(compiler, OP_LESS_JUMP_IF_FALSE);
+    }
+#endif
+    *fused = false;
+    int jump = emitJump(compiler, OP_JUMP_IF_FALSE);
+    emitByte(compiler, OP_POP);
+    return jump;
+}
+
+// A trailing expression without a semicolon is left on the stack as the
+// result of the script.
+void expressionStatement(Compiler* compiler) {
+    expression(compiler);
+    if (compiler->type == TYPE_SCRIPT && compiler->scopeDepth == 0 &&
+        checkToken(compiler->parser, TOKEN_EOF)) {
+        compiler->hasResult = true;
+        return;
+    }
+    consume(compiler->parser, compiler->tokenizer, TOKEN_SEMICOLON, "Expect ';' after expression.");
+    discardResult(compiler);
+}
+
+// Match case labels must be known at compile time: numbers, booleans,
+// nil and enum members.
+bool constantLabel(Compiler* compiler, Value* value) {
+    Parser* parser = compiler->parser;
+    Tokenizer* tokenizer = compiler->tokenizer;
+    if (matchToken(parser, tokenizer, TOKEN_NUMBER)) {
+        *value = NUMBER_VAL(strtod(parser->previous->start, NULL));
+        return true;
+    }
+    if (matchToken(parser, tokenizer, TOKEN_MINUS)) {
+        consume(parser, tokenizer, TOKEN_NUMBER, "Expect number after '-'.");
+        *value = NUMBER_VAL(-strtod(parser->previous->start, NULL));
+        return true;
+    }
+    if (matchToken(parser, tokenizer, TOKEN_BOOLEAN)) {
+        *value = BOOL_VAL(parser->previous->start[0] == 't');
+        return true;
+    }
+    if (matchToken(parser, tokenizer, TOKEN_NIL)) {
+        *value = NIL_VAL;
+        return true;
+    }
+    if (matchToken(parser, tokenizer, TOKEN_ID)) {
+        Token* name = parser->previous;
+        int slot = findGlobal(compiler->globals, name->start, name->length);
+        if (slot != -1 && compiler->globals->kinds[slot] == GLOBAL_ENUM) {
+            int member = resolveEnumMember(compiler, slot);
+            if (member != -1) {
+                *value = compiler->globals->values[member];
+                return true;
+            }
+            return false;
+        }
+    }
+    error(parser, "Match cases must be constants.");
+    return false;
+}
+
+// Picks the dispatch for a match once all of its cases are known: a direct
+// jump table when the cases are dense integers, a binary search over
+// sorted keys when they are sparse numbers, and a linear scan otherwise.
+void buildJumpTable(Compiler* compiler, int dispatch, int tableIndex, Value* keys,
+        int* targets, int count, int defaultTarget) {
+    Chunk* chunk = currentChunk(compiler);
+    JumpTable* table = &chunk->tables[tableIndex];
+    bool allNumbers = true;
+    bool allIntegers = true;
+    double min = 0;
+    double max = 0;
+    for (int i = 0; i < count; i++) {
+        if (!IS_NUMBER(keys[i])) {
+            allNumbers = false;
+            allIntegers = false;
+            break;
+        }
+        double key = AS_NUMBER(keys[i]);
+        if (key < INT16_MIN || key > INT16_MAX || key != (double)(int)key) {
+            allIntegers = false;
+        }
+        if (i == 0 || key < min) {
+            min = key;
+        }
+        if (i == 0 || key > max) {
+            max = key;
+        }
+    }
+    table->defaultTarget = defaultTarget;
+    if (allIntegers && count >= MATCH_TABLE_MIN_CASES && max - min + 1 <= 2.0 * count) {
+        int range = (int)(max - min) + 1;
+        table->min = min;
+        table->count = range;
+        table->targets = malloc(sizeof(int) * range);
+        for (int i = 0; i < range; i++) {
+            table->targets[i] = defaultTarget;
+        }
+        for (int i = 0; i < count; i++) {
+            table->targets[(int)(AS_NUMBER(keys[i]) - min)] = targets[i];
+        }
+        free(keys);
+        free(targets);
+        chunk->code[dispatch] = OP_JUMP_TABLE;
+        return;
+    }
+    if (allNumbers && count >= MATCH_SEARCH_MIN_CASES) {
+        for (int i = 1; i < count; i++) {
+            Value key = keys[i];
+            int target = targets[i];
+            int j = i - 1;
+            while (j >= 0 && AS_NUMBER(keys[j]) > AS_NUMBER(key)) {
+                keys[j + 1] = keys[j];
+                targets[j + 1] = targets[j];
+                j--;
+            }
+            keys[j + 1] = key;
+            targets[j + 1] = target;
+        }
+        chunk->code[dispatch] = OP_JUMP_SEARCH;
+    }
+    else {
+        chunk->code[dispatch] = OP_JUMP_LINEAR;
+    }
+    table->count = count;
+    table->keys = keys;
+    table->targets = targets;
+}
+
+// The dispatch instruction is emitted ahead of the arms with a placeholder
+// opcode; arm bodies follow it, each jumping to the end, and the opcode and
+// table are filled in once every case label has been seen.
+void matchStatement(Compiler* compiler) {
+    Parser* parser = compiler->parser;
+    Tokenizer* tokenizer = compiler->tokenizer;
+    Chunk* chunk = currentChunk(compiler);
+    consume(parser, tokenizer, TOKEN_LEFT_PAREN, "Expect '(' after 'match'.");
+    expression(compiler);
+    consume(parser, tokenizer, TOKEN_RIGHT_PAREN, "Expect ')' after match subject.");
+    consume(parser, tokenizer, TOKEN_LEFT_CURLY, "Expect '{' before match arms.");
+    int tableIndex = addJumpTable(chunk);
+    if (tableIndex > UINT16_MAX) {
+        error(parser, "Too many match statements in one chunk.");
+    }
+    int dispatch = chunk->count;
+    emitShort(compiler, OP_JUMP_LINEAR, (uint16_t)tableIndex);
+
+    int count = 0;
+    int capacity = 0;
+    Value* keys = NULL;
+    int* targets = NULL;
+    int exitCount = 0;
+    int exitCapacity = 0;
+    int* exits = NULL;
+    int defaultTarget = -1;
+    while (!checkToken(parser, TOKEN_RIGHT_CURLY) && !checkToken(parser, TOKEN_EOF)) {
+        int target = chunk->count;
+        Token* current = parser->current;
+        if (current->type == TOKEN_ID && current->length == 1 && current->start[0] == '_') {
+            advanceToken(parser, tokenizer);
+            if (defaultTarget != -1) {
+                error(parser, "Match already has a default case.");
+            }
+            defaultTarget = target;
+        }
+        else {
+            do {
+                Value key;
+                if (!constantLabel(compiler, &key)) {
+                    break;
+                }
+                for (int i = 0; i < count; i++) {
+                    if (valuesEqual(keys[i], key)) {
+                        error(parser, "Duplicate match case.");
+                    }
+                }
+                if (capacity < count + 1) {
+                    int oldCapacity = capacity;
+                    capacity = grow_capacity(oldCapacity);
+                    keys = grow_array(keys, Value, oldCapacity, capacity);
+                    targets = grow_array(targets, int, oldCapacity, capacity);
+                }
+                keys[count] = key;
+                targets[count] = target;
+                count++;
+            } while (matchToken(parser, tokenizer, TOKEN_COMMA));
+        }
+        consume(parser, tokenizer, TOKEN_PERFORM, "Expect '->' after match case.");
+        statement(compiler);
+        if (exitCapacity < exitCount + 1) {
+            int oldCapacity = exitCapacity;
+            exitCapacity = grow_capacity(oldCapacity);
+            exits = grow_array(exits, int, oldCapacity, exitCapacity);
+        }
+        exits[exitCount++] = emitJump(compiler, OP_JUMP);
+        if (parser->panicMode) {
+            break;
+        }
+    }
+    consume(parser, tokenizer, TOKEN_RIGHT_CURLY, "Expect '}' after match arms.");
+    for (int i = 0; i < exitCount; i++) {
+        patchJump(compiler, exits[i]);
+    }
+    free(exits);
+    if (defaultTarget == -1) {
+        defaultTarget = chunk->count;
+    }
+    buildJumpTable(compiler, dispatch, tableIndex, keys, targets, count, defaultTarget);
+}
+
+// Links an included module into this script's tables and runs its
+// top-level code in place. The module itself was compiled once, usually in
+// the background after the includer's source was skimmed.
+void includeStatement(Compiler* compiler) {
+    Parser* parser = compiler->parser;
+    consume(parser, compiler->tokenizer, TOKEN_STRING, "Expect module path after 'include'.");
+    Token* path = parser->previous;
+    consume(parser, compiler->tokenizer, TOKEN_SEMICOLON, "Expect ';' after include.");
+    if (compiler->type != TYPE_SCRIPT || compiler->scopeDepth > 0) {
+        error(parser, "Can only include at the top level.");
+        return;
+    }
+    char* name = copyName(path->start + 1, path->length - 2);
+    Module* module = requestModule(compiler->modules, name, false);
+    free(name);
+    if (module == NULL) {
+        error(parser, "Could not read module.");
+        return;
+    }
+    if (!awaitModule(compiler->modules, module, compiler->module)) {
+        error(parser, "Circular include.");
+        return;
+    }
+    if (module->function == NULL) {
+        error(parser, "Could not compile module.");
+        return;
+    }
+    ObjFunction* linked;
+    const char* message = linkModule(module, compiler->globals, compiler->symbols, &linked);
+    if (message != NULL) {
+        error(parser, message);
+        return;
+    }
+    if (linked == NULL) {
+        return;
+    }
+    emitConstant(compiler, OBJ_VAL(linked));
+    emitBytes(compiler, OP_CALL, 0);
+    emitByte(compiler, OP_POP);
+}
+
+void ifStatement(Compiler* compiler) {
+    Parser* parser = compiler->parser;
+    consume(parser, compiler->tokenizer, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    expression(compiler);
+    consume(parser, compiler->tokenizer, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    bool fused;
+    int thenJump = emitConditionJump(compiler, &fused);
+    statement(compiler);
+    int elseJump = emitJump(compiler, OP_JUMP);
+    patchJump(compiler, thenJump);
+    if (!fused) {
+        emitByte(compiler, OP_POP);
+    }
+    if (matchToken(parser, compiler->tokenizer, TOKEN_ELIF)) {
+        ifStatement(compiler);
+    }
+    else if (matchToken(parser, compiler->tokenizer, TOKEN_ELSE)) {
+        statement(compiler);
+    }
+    patchJump(compiler, elseJump);
+}
+
+// A for loop of the form for (...; i < limit; i++), with i a local and
+// limit a local or a number, is rotated: the condition is tested once on
+// entry, and after each iteration OP_INCR_LOCAL and OP_LOOP_LT bump the
+// counter and jump back while it is below the limit. A number limit is
+// kept in a hidden local. The clauses are matched on a copy of the
+// tokenizer; returns false, having compiled nothing, if they don't fit.
+bool countedLoop(Compiler* compiler) {
+    Parser* parser = compiler->parser;
+    Token* counterName = parser->current;
+    if (counterName->type != TOKEN_ID) {
+        return false;
+    }
+    int counter = resolveLocal(compiler, counterName);
+    if (counter == -1) {
+        return false;
+    }
+    Tokenizer lookahead = *compiler->tokenizer;
+    Token* tokens[6];
+    for (int i = 0; i < 6; i++) {
+        tokens[i] = scanToken(&lookahead);
+    }
+    bool counted = tokens[0]->type == TOKEN_LESS &&
+        (tokens[1]->type == TOKEN_ID || tokens[1]->type == TOKEN_NUMBER) &&
+        tokens[2]->type == TOKEN_SEMICOLON &&
+        tokens[3]->type == TOKEN_ID && identifiersEqual(tokens[3], counterName) &&
+        tokens[4]->type == TOKEN_INCR && tokens[5]->type == TOKEN_RIGHT_PAREN;
+    int limit = -1;
+    if (counted && tokens[1]->type == TOKEN_ID) {
+        limit = resolveLocal(compiler, tokens[1]);
+        counted = limit != -1;
+    }
+    for (int i = 0; i < 6; i++) {
+        free(tokens[i]);
+    }
+    if (!counted) {
+        return false;
+    }
+    advanceToken(parser, compiler->tokenizer);
+    advanceToken(parser, compiler->tokenizer);
+    advanceToken(parser, compiler->tokenizer);
+    if (parser->previous->type == TOKEN_NUMBER) {
+        numeric(compiler, false);
+        // Named by the number token, which no identifier can match.
+        addLocal(compiler, parser->previous);
+        markInitialized(compiler);
+        limit = compiler->localCount - 1;
+    }
+    for (int i = 0; i < 4; i++) {
+        advanceToken(parser, compiler->tokenizer);
+    }
+    emitBytes(compiler, OP_GET_LOCAL, (uint8_t)counter);
+    emitBytes(compiler, OP_GET_LOCAL, (uint8_t)limit);
+    int exitJump = emitJump(compiler, OP_LESS_JUMP_IF_FALSE);
+    int bodyStart = currentChunk(compiler)->count;
+    statement(compiler);
+    emitBytes(compiler, OP_INCR_LOCAL, (uint8_t)counter);
+    emitByte(compiler, 1);
+    emitLoopLess(compiler, counter, limit, bodyStart);
+    patchJump(compiler, exitJump);
+    return true;
+}
+
+// for (initializer; condition; increment) body. Variables declared by the
+// initializer are scoped to the loop.
+void forStatement(Compiler* compiler) {
+    Parser* parser = compiler->parser;
+    beginScope(compiler);
+    consume(parser, compiler->tokenizer, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (matchToken(parser, compiler->tokenizer, TOKEN_SEMICOLON)) {
+        // No initializer.
+    }
+    else if (isTypeToken(parser->current->type)) {
+        advanceToken(parser, compiler->tokenizer);
+        varDeclaration(compiler, declaredType(parser->previous->type));
+    }
+    else {
+        expressionStatement(compiler);
+    }
+#ifndef NO_LOOP_FUSION
+    if (countedLoop(compiler)) {
+        endScope(compiler);
+        return;
+    }
+#endif
+    int loopStart = currentChunk(compiler)->count;
+    int exitJump = -1;
+    bool fused = false;
+    if (!matchToken(parser, compiler->tokenizer, TOKEN_SEMICOLON)) {
+        expression(compiler);
+        consume(parser, compiler->tokenizer, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+        exitJump = emitConditionJump(compiler, &fused);
+    }
+    if (!matchToken(parser, compiler->tokenizer, TOKEN_RIGHT_PAREN)) {
+        int bodyJump = emitJump(compiler, OP_JUMP);
+        int incrementStart = currentChunk(compiler)->count;
+        expression(compiler);
+        discardResult(compiler);
+        consume(parser, compiler->tokenizer, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+        emitLoop(compiler, loopStart);
+        loopStart = incrementStart;
+        patchJump(compiler, bodyJump);
+    }
+    statement(compiler);
+    emitLoop(compiler, loopStart);
+    if (exitJump != -1) {
+        patchJump(compiler, exitJump);
+        if (!fused) {
+            emitByte(compiler, OP_POP);
+        }
+    }
+    endScope(compiler);
+}
+
+void whileStatement(Compiler* compiler) {
+    Parser* parser = compiler->parser;
+    int loopStart = currentChunk(compiler)->count;
+    consume(parser, compiler->tokenizer, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    expression(compiler);
+    consume(parser, compiler->tokenizer, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    bool fused;
+    int exitJump = emitConditionJump(compiler, &fused);
+    statement(compiler);
+    emitLoop(compiler, loopStart);
+    patchJump(compiler, exitJump);
+    if (!fused) {
+        emitByte(compiler, OP_POP);
+    }
+}
+
+// A call whose result is returned directly is rewritten to OP_TAIL_CALL,
+// which reuses the current frame instead of pushing a new one.
+void returnStatement(Compiler* compiler) {
+    Parser* parser = compiler->parser;
+    if (compiler->type == TYPE_SCRIPT) {
+        error(parser, "Can't return from top-level code.");
+    }
+    if (matchToken(parser, compiler->tokenizer, TOKEN_SEMICOLON)) {
+        emitReturn(compiler);
+        return;
+    }
+    expression(compiler);
+    consume(parser, compiler->tokenizer, TOKEN_SEMICOLON, "Expect ';' after return value.");
+    Chunk* chunk = currentChunk(compiler);
+    if (compiler->lastCall != -1 && compiler->lastCall == chunk->count - 2 &&
+        compiler->tryDepth == 0) {
+        chunk->code[compiler->lastCall] = OP_TAIL_CALL;
+    }
+    emitByte(compiler, OP_RETURN);
+}
+
+// A try block costs nothing to enter: its code range goes into the
+// chunk's exception table with the stack depth at the try, and only a
+// raised error looks the table up. The normal path just jumps over the
+// catch block, which starts with the error on the stack, bound to the
+// name in parentheses or popped.
+void tryStatement(Compiler* compiler) {
+    Parser* parser = compiler->parser;
+    Tokenizer* tokenizer = compiler->tokenizer;
+    Chunk* chunk = currentChunk(compiler);
+    consume(parser, tokenizer, TOKEN_LEFT_CURLY, "Expect '{' after 'try'.");
+    int start = chunk->count;
+    int depth = compiler->localCount;
+    compiler->tryDepth++;
+    beginScope(compiler);
+    block(compiler);
+    endScope(compiler);
+    compiler->tryDepth--;
+    int end = chunk->count;
+    int exitJump = emitJump(compiler, OP_JUMP);
+    int handler = chunk->count;
+    compiler->lastTarget = handler;
+    consume(parser, tokenizer, TOKEN_CATCH, "Expect 'catch' after try block.");
+    beginScope(compiler);
+    if (matchToken(parser, tokenizer, TOKEN_LEFT_PAREN)) {
+        consume(parser, tokenizer, TOKEN_ID, "Expect error name after '('.");
+        declareLocal(compiler);
+        markInitialized(compiler);
+        consume(parser, tokenizer, TOKEN_RIGHT_PAREN, "Expect ')' after error name.");
+    }
+    else {
+        emitByte(compiler, OP_POP);
+    }
+    consume(parser, tokenizer, TOKEN_LEFT_CURLY, "Expect '{' after catch.");
+    block(compiler);
+    endScope(compiler);
+    patchJump(compiler, exitJump);
+    if (end > start) {
+        addHandler(chunk, start, end, handler, depth);
+    }
+}
+
+void errorStatement(Compiler* compiler) {
+    expression(compiler);
+    consume(compiler->parser, compiler->tokenizer, TOKEN_SEMICOLON, "Expect ';' after error value.");
+    emitByte(compiler, OP_THROW);
+}
+
+void synchronize(Compiler* compiler) {
+    Parser* parser = compiler->parser;
+    parser->panicMode = false;
+    while (parser->current->type != TOKEN_EOF) {
+        if (parser->previous->type == TOKEN_SEMICOLON) {
+            return;
+        }
+        switch (parser->current->type) {
+            case TOKEN_FN:
+            case TOKEN_STRUCT:
+            case TOKEN_ENUM:
+            case TOKEN_IF:
+            case TOKEN_MATCH:
+            case TOKEN_INCLUDE:
+            case TOKEN_WHILE:
+            case TOKEN_FOR:
+            case TOKEN_RETURN:
+            case TOKEN_TRY:
+            case TOKEN_ERROR:
+            case TOKEN_REAL:
+            case TOKEN_CHAR:
+            case TOKEN_BOOL:
+            case TOKEN_VOID:
+            case TOKEN_FREE:
+                return;
+            default:
+                ;
+        }
+        advanceToken(parser, compiler->tokenizer);
+    }
+}
+
+void statement(Compiler* compiler) {
+    Parser* parser = compiler->parser;
+    if (matchToken(parser, compiler->tokenizer, TOKEN_IF)) {
+        ifStatement(compiler);
+    }
+    else if (matchToken(parser, compiler->tokenizer, TOKEN_WHILE)) {
+        whileStatement(compiler);
+    }
+    else if (matchToken(parser, compiler->tokenizer, TOKEN_FOR)) {
+        forStatement(compiler);
+    }
+    else if (matchToken(parser, compiler->tokenizer, TOKEN_MATCH)) {
+        matchStatement(compiler);
+    }
+    else if (matchToken(parser, compiler->tokenizer, TOKEN_INCLUDE)) {
+        includeStatement(compiler);
+    }
+    else if (matchToken(parser, compiler->tokenizer, TOKEN_RETURN)) {
+        returnStatement(compiler);
+    }
+    else if (matchToken(parser, compiler->tokenizer, TOKEN_TRY)) {
+        tryStatement(compiler);
+    }
+    else if (matchToken(parser, compiler->tokenizer, TOKEN_ERROR)) {
+        errorStatement(compiler);
+    }
+    else if (matchToken(parser, compiler->tokenizer, TOKEN_LEFT_CURLY)) {
+        beginScope(compiler);
+        block(compiler);
+        endScope(compiler);
+    }
+    else {
+        expressionStatement(compiler);
+    }
+}
+
+void declaration(Compiler* compiler) {
+    Parser* parser = compiler->parser;
+    if (matchToken(parser, compiler->tokenizer, TOKEN_FN)) {
+        fnDeclaration(compiler);
+    }
+    else if (matchToken(parser, compiler->tokenizer, TOKEN_STRUCT)) {
+        structDeclaration(compiler);
+    }
+    else if (matchToken(parser, compiler->tokenizer, TOKEN_ENUM)) {
+        enumDeclaration(compiler);
+    }
+    else if (isTypeToken(parser->current->type)) {
+        advanceToken(parser, compiler->tokenizer);
+        varDeclaration(compiler, declaredType(parser->previous->type));
+    }
+    else {
+        statement(compiler);
+    }
+    if (parser->panicMode) {
+        synchronize(compiler);
+    }
+}
+
+// Skimmed functions point into the source, so the compiler works on a copy
+// that is kept for as long as any of them may still be called.
+ObjFunction* compileModule(const char* source, Globals* globals, Symbols* symbols,
+        ModuleCache* modules, Module* module) {
+    prefetchIncludes(modules, source);
+    char* retained = copyName(source, (int)strlen(source));
+    Tokenizer* tokenizer = initTokenizer(retained);
     Parser* parser = initParser();
-    advance(parser, tokenizer);
-    expression();
-    consume(TOKEN_EOF, "Expect end of expression.");
-    return !parser->hadError;
+    Compiler* compiler = initCompiler(NULL, parser, tokenizer, globals, symbols, TYPE_SCRIPT);
+    compiler->modules = modules;
+    compiler->module = module;
+    advanceToken(parser, tokenizer);
+    while (!matchToken(parser, tokenizer, TOKEN_EOF)) {
+        declaration(compiler);
+    }
+    bool lazy = compiler->lazyFunctions > 0;
+    ObjFunction* function = endCompiler(compiler);
+    bool hadError = parser->hadError;
+    free(parser);
+    free(tokenizer);
+    if (!lazy || hadError) {
+        free(retained);
+    }
+    return hadError ? NULL : function;
+}
+
+ObjFunction* compile(const char* source, Globals* globals, Symbols* symbols, ModuleCache* modules) {
+    return compileModule(source, globals, symbols, modules, NULL);
 }
 
-#endif
\ No newline at end of file
+#endif
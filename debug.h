@@ -11,6 +11,11 @@ void disassembleChunk(Chunk* chunk, const char* name) {
     for (int offset = 0; offset < chunk->count;) {
         offset = disassembleInstruction(chunk, offset);
     }
+    for (int i = 0; i < chunk->handlerCount; i++) {
+        Handler* handler = &chunk->handlers[i];
+        printf("try %04d-%04d catch %04d depth %d\n", handler->start, handler->end,
+                handler->target, handler->depth);
+    }
 }
 
 static int constantInstruction(const char* name, Chunk* chunk, int offset) {
@@ -21,6 +26,100 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2;
 }
 
+static int shortInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    printf("%-16s %4d\n", name, slot);
+    return offset + 3;
+}
+
+static int byteInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    printf("%-16s %4d\n", name, slot);
+    return offset + 2;
+}
+
+static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
+    uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+    return offset + 3;
+}
+
+static int fieldInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t index = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    InlineCache* cache = &chunk->caches[index];
+    printf("%-16s %4d symbol %d (%d cached)\n", name, index, cache->symbol, cache->count);
+    return offset + 3;
+}
+
+static int tableInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t index = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    JumpTable* table = &chunk->tables[index];
+    printf("%-16s %4d (%d cases, default -> %d)\n", name, index, table->count, table->defaultTarget);
+    return offset + 3;
+}
+
+static int constantLongInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t constant = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants->values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static int loopInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    uint16_t loop = (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+    printf("%-16s %4d -> %d (loop %d, hotness %d)\n", name, offset, offset + 5 - jump, loop,
+            chunk->loops[loop].hotness);
+    return offset + 5;
+}
+
+static int incrementInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    int8_t delta = (int8_t)chunk->code[offset + 2];
+    printf("%-16s %4d %+d\n", name, slot, delta);
+    return offset + 3;
+}
+
+// Compares two local slots and jumps back while the first is less.
+static int loopLessInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t counter = chunk->code[offset + 1];
+    uint8_t limit = chunk->code[offset + 2];
+    uint16_t jump = (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+    uint16_t loop = (uint16_t)((chunk->code[offset + 5] << 8) | chunk->code[offset + 6]);
+    printf("%-16s %4d < %d -> %d (loop %d, hotness %d)\n", name, counter, limit,
+            offset + 7 - jump, loop, chunk->loops[loop].hotness);
+    return offset + 7;
+}
+
+// Fused arithmetic: the operator, then two operands that are local slots
+// (L), global slots (G) or constant indexes (K), by the opcode's suffix.
+static int binaryInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t op = chunk->code[offset + 1];
+    int a;
+    int b;
+    int next;
+    switch (chunk->code[offset]) {
+        case OP_BINARY_LL:
+            a = chunk->code[offset + 2];
+            b = chunk->code[offset + 3];
+            next = offset + 4;
+            break;
+        case OP_BINARY_LK:
+            a = chunk->code[offset + 2];
+            b = (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+            next = offset + 5;
+            break;
+        default:
+            a = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+            b = (chunk->code[offset + 4] << 8) | chunk->code[offset + 5];
+            next = offset + 6;
+            break;
+    }
+    printf("%-16s %4d %d %d\n", name, op, a, b);
+    return next;
+}
+
 static int simpleInstruction(const char* name, int offset) {
     printf("%s\n", name);
     return offset + 1;
@@ -50,6 +149,100 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_MULT", offset);
         case OP_DIV:
             return simpleInstruction("OP_DIV", offset);
+        case OP_NIL:
+            return simpleInstruction("OP_NIL", offset);
+        case OP_POP:
+            return simpleInstruction("OP_POP", offset);
+        case OP_GET_GLOBAL:
+            return shortInstruction("OP_GET_GLOBAL", chunk, offset);
+        case OP_SET_GLOBAL:
+            return shortInstruction("OP_SET_GLOBAL", chunk, offset);
+        case OP_TRUE:
+            return simpleInstruction("OP_TRUE", offset);
+        case OP_FALSE:
+            return simpleInstruction("OP_FALSE", offset);
+        case OP_EQUAL:
+            return simpleInstruction("OP_EQUAL", offset);
+        case OP_GREATER:
+            return simpleInstruction("OP_GREATER", offset);
+        case OP_LESS:
+            return simpleInstruction("OP_LESS", offset);
+        case OP_NOT:
+            return simpleInstruction("OP_NOT", offset);
+        case OP_GET_LOCAL:
+            return byteInstruction("OP_GET_LOCAL", chunk, offset);
+        case OP_SET_LOCAL:
+            return byteInstruction("OP_SET_LOCAL", chunk, offset);
+        case OP_JUMP:
+            return jumpInstruction("OP_JUMP", 1, chunk, offset);
+        case OP_JUMP_IF_FALSE:
+            return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_LOOP:
+            return loopInstruction("OP_LOOP", chunk, offset);
+        case OP_CALL:
+            return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
+        case OP_GET_FIELD:
+            return fieldInstruction("OP_GET_FIELD", chunk, offset);
+        case OP_SET_FIELD:
+            return fieldInstruction("OP_SET_FIELD", chunk, offset);
+        case OP_JUMP_TABLE:
+            return tableInstruction("OP_JUMP_TABLE", chunk, offset);
+        case OP_JUMP_SEARCH:
+            return tableInstruction("OP_JUMP_SEARCH", chunk, offset);
+        case OP_JUMP_LINEAR:
+            return tableInstruction("OP_JUMP_LINEAR", chunk, offset);
+        case OP_ADD_REAL:
+            return simpleInstruction("OP_ADD_REAL", offset);
+        case OP_SUB_REAL:
+            return simpleInstruction("OP_SUB_REAL", offset);
+        case OP_MULT_REAL:
+            return simpleInstruction("OP_MULT_REAL", offset);
+        case OP_DIV_REAL:
+            return simpleInstruction("OP_DIV_REAL", offset);
+        case OP_NEGATE_REAL:
+            return simpleInstruction("OP_NEGATE_REAL", offset);
+        case OP_LESS_REAL:
+            return simpleInstruction("OP_LESS_REAL", offset);
+        case OP_GREATER_REAL:
+            return simpleInstruction("OP_GREATER_REAL", offset);
+        case OP_EQUAL_REAL:
+            return simpleInstruction("OP_EQUAL_REAL", offset);
+        case OP_GUARD_REAL:
+            return simpleInstruction("OP_GUARD_REAL", offset);
+        case OP_CONSTANT_LONG:
+            return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
+        case OP_INCR_LOCAL:
+            return incrementInstruction("OP_INCR_LOCAL", chunk, offset);
+        case OP_LESS_JUMP_IF_FALSE:
+            return jumpInstruction("OP_LESS_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_LOOP_LT:
+            return loopLessInstruction("OP_LOOP_LT", chunk, offset);
+        case OP_VECTOR:
+            return byteInstruction("OP_VECTOR", chunk, offset);
+        case OP_GET_INDEX:
+            return simpleInstruction("OP_GET_INDEX", offset);
+        case OP_SET_INDEX:
+            return simpleInstruction("OP_SET_INDEX", offset);
+        case OP_THROW:
+            return simpleInstruction("OP_THROW", offset);
+        case OP_BINARY_LL:
+            return binaryInstruction("OP_BINARY_LL", chunk, offset);
+        case OP_BINARY_LK:
+            return binaryInstruction("OP_BINARY_LK", chunk, offset);
+        case OP_BINARY_GG:
+            return binaryInstruction("OP_BINARY_GG", chunk, offset);
+        case OP_BINARY_GK:
+            return binaryInstruction("OP_BINARY_GK", chunk, offset);
+        case OP_SET_LOCAL_POP:
+            return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+        case OP_SET_GLOBAL_POP:
+            return shortInstruction("OP_SET_GLOBAL_POP", chunk, offset);
+        case OP_JUMP_IF_FALSE_POP:
+            return jumpInstruction("OP_JUMP_IF_FALSE_POP", 1, chunk, offset);
+        case OP_JUMP_BACK:
+            return jumpInstruction("OP_JUMP_BACK", -1, chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
@@ -0,0 +1,150 @@
+#ifndef globals_h
+#define globals_h
+
+#include <string.h>
+#include "common.h"
+#include "memory.h"
+#include "value.h"
+
+#define GLOBALS_MAX (UINT16_MAX + 1)
+
+enum GlobalKind_ {
+    GLOBAL_VARIABLE,
+    GLOBAL_CONSTANT,
+    GLOBAL_ENUM
+};
+typedef enum GlobalKind_ GlobalKind;
+
+// Global variables live in a flat array indexed by slots the compiler
+// assigns; names are only kept for resolving identifiers at compile time
+// and for reporting undefined variables. Constants (enum members, stored
+// under their qualified name) have their value filled in by the compiler,
+// which folds them instead of emitting loads. index is an open-addressed
+// hash of names to slots, so resolving identifiers in scripts with
+// thousands of globals doesn't scan the name list. used is set once
+// compiled code loads or stores a slot; code compiled against its declared
+// type relies on it, so from then on the type can't change.
+struct Globals_ {
+    int count;
+    int capacity;
+    Value* values;
+    char** names;
+    uint8_t* kinds;
+    uint8_t* types;
+    bool* used;
+    int* index;
+    int indexCapacity;
+};
+typedef struct Globals_ Globals;
+
+Globals* initGlobals();
+int findGlobal(Globals* globals, const char* name, int length);
+int addGlobal(Globals* globals, const char* name, int length);
+void freeGlobals(Globals* globals);
+
+Globals* initGlobals() {
+    Globals* globals = malloc(sizeof(Globals));
+    globals->count = 0;
+    globals->capacity = 0;
+    globals->values = NULL;
+    globals->names = NULL;
+    globals->kinds = NULL;
+    globals->types = NULL;
+    globals->used = NULL;
+    globals->index = NULL;
+    globals->indexCapacity = 0;
+    return globals;
+}
+
+// 32-bit FNV-1a.
+static inline uint32_t hashName(const char* name, int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int findGlobal(Globals* globals, const char* name, int length) {
+    if (globals->indexCapacity == 0) {
+        return -1;
+    }
+    uint32_t mask = globals->indexCapacity - 1;
+    for (uint32_t i = hashName(name, length) & mask; globals->index[i] != -1; i = (i + 1) & mask) {
+        const char* candidate = globals->names[globals->index[i]];
+        if (strncmp(candidate, name, length) == 0 && candidate[length] == '\0') {
+            return globals->index[i];
+        }
+    }
+    return -1;
+}
+
+static void indexGlobal(Globals* globals, int slot) {
+    uint32_t mask = globals->indexCapacity - 1;
+    const char* name = globals->names[slot];
+    uint32_t i = hashName(name, (int)strlen(name)) & mask;
+    while (globals->index[i] != -1) {
+        i = (i + 1) & mask;
+    }
+    globals->index[i] = slot;
+}
+
+// Keeps the index at most three-quarters full.
+static void growGlobalIndex(Globals* globals) {
+    free(globals->index);
+    globals->indexCapacity = globals->indexCapacity < 16 ? 16 : globals->indexCapacity * 2;
+    globals->index = malloc(sizeof(int) * globals->indexCapacity);
+    memset(globals->index, 0xff, sizeof(int) * globals->indexCapacity);
+    for (int i = 0; i < globals->count; i++) {
+        indexGlobal(globals, i);
+    }
+}
+
+int addGlobal(Globals* globals, const char* name, int length) {
+    if (globals->capacity < globals->count + 1) {
+        int oldCapacity = globals->capacity;
+        globals->capacity = grow_capacity(oldCapacity);
+        globals->values = grow_array(globals->values, Value, oldCapacity,
+                globals->capacity);
+        globals->names = grow_array(globals->names, char*, oldCapacity,
+                globals->capacity);
+        globals->kinds = grow_array(globals->kinds, uint8_t, oldCapacity,
+                globals->capacity);
+        globals->types = grow_array(globals->types, uint8_t, oldCapacity,
+                globals->capacity);
+        globals->used = grow_array(globals->used, bool, oldCapacity,
+                globals->capacity);
+    }
+    char* copy = malloc(length + 1);
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    globals->values[globals->count] = UNDEFINED_VAL;
+    globals->names[globals->count] = copy;
+    globals->kinds[globals->count] = GLOBAL_VARIABLE;
+    globals->types[globals->count] = STATIC_ANY;
+    globals->used[globals->count] = false;
+    globals->count++;
+    if (globals->count * 4 > globals->indexCapacity * 3) {
+        growGlobalIndex(globals);
+    }
+    else {
+        indexGlobal(globals, globals->count - 1);
+    }
+    return globals->count - 1;
+}
+
+void freeGlobals(Globals* globals) {
+    for (int i = 0; i < globals->count; i++) {
+        free(globals->names[i]);
+    }
+    free_array(Value, globals->values, globals->capacity);
+    free_array(char*, globals->names, globals->capacity);
+    free_array(uint8_t, globals->kinds, globals->capacity);
+    free_array(uint8_t, globals->types, globals->capacity);
+    free_array(bool, globals->used, globals->capacity);
+    free(globals->index);
+    free(globals);
+}
+
+#endif
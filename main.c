@@ -1,3 +1,8 @@
+// Feature-test macros must come before any system header. -std=c11 hides
+// the POSIX and XSI interfaces: open_memstream in server.h, and sigaction
+// and SA_RESTART in profiler.h.
+#define _XOPEN_SOURCE 700
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,12 +10,14 @@
 #include "chunk.h"
 #include "debug.h"
 #include "vm.h"
+#include "server.h"
+#include "profiler.h"
 
 void repl(VM* vm) {
     char* line = malloc(1024*sizeof(char));
     for (;;) {
         printf("> ");
-        if (!fgets(line, sizeof(line), stdin)) {
+        if (!fgets(line, 1024*sizeof(char), stdin)) {
             printf("\n");
             break;
         }
@@ -42,11 +49,7 @@ char* readFile(const char* path) {
     return buffer;
 }
 
-void runFile(VM* vm, const char* path) {
-    char* source = readFile(path);
-    InterpretResult result = interpret(vm, source);
-    free(source);
-    
+void exitOnError(InterpretResult result) {
     if (result == INTERPRET_COMPILE_ERROR) {
         exit(2);
     }
@@ -55,17 +58,52 @@ void runFile(VM* vm, const char* path) {
     }
 }
 
+void runFile(VM* vm, const char* path) {
+    char* source = readFile(path);
+    InterpretResult result = interpret(vm, source);
+    free(source);
+    exitOnError(result);
+}
+
+// Runs a script under the sampling profiler and writes its folded stacks
+// to output, even if the script fails.
+void profileFile(VM* vm, const char* path, const char* output) {
+    FILE* file = fopen(output, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file %s.\n", output);
+        exit(4);
+    }
+    char* source = readFile(path);
+    Profiler* profiler = initProfiler(vm);
+    startProfiler(profiler);
+    InterpretResult result = interpret(vm, source);
+    stopProfiler(profiler);
+    writeFoldedStacks(profiler, file);
+    fclose(file);
+    freeProfiler(profiler);
+    free(source);
+    exitOnError(result);
+}
+
 int main(int argc, const char* argv[]) {
     VM* vm = initVM();
     
     if (argc == 1) {
         repl(vm);
     }
+    else if (strcmp(argv[1], "--serve") == 0 && argc <= 3) {
+        if (!serve(vm, argc == 3 ? argv[2] : NULL)) {
+            exit(5);
+        }
+    }
+    else if (strcmp(argv[1], "--profile") == 0 && argc == 4) {
+        profileFile(vm, argv[3], argv[2]);
+    }
     else if (argc == 2) {
         runFile(vm, argv[1]);
     }
     else {
-        fprintf(stderr, "Usage: ctcomp <file>\n");
+        fprintf(stderr, "Usage: ctcomp <file> | ctcomp --profile <output> <file> | ctcomp --serve [socket]\n");
         exit(1);
     }
     
@@ -0,0 +1,358 @@
+#ifndef modules_h
+#define modules_h
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "chunk.h"
+#include "object.h"
+#include "globals.h"
+#include "symbols.h"
+#include "tokenizer.h"
+
+struct ModuleCache_;
+typedef struct ModuleCache_ ModuleCache;
+
+// A module compiled against its own globals and symbols. Linking clones
+// the function tree and relocates its global slots and field symbols into
+// the includer's tables, so one compiled module can be linked anywhere.
+// source is kept to tell apart modules whose contents hash alike.
+struct Module_ {
+    uint64_t hash;
+    size_t length;
+    char* source;
+    ObjFunction* function;
+    Globals* globals;
+    Symbols* symbols;
+    ModuleCache* cache;
+    bool ready;
+    struct Module_* waitingOn;
+    struct Module_* next;
+};
+typedef struct Module_ Module;
+
+// Modules are keyed by the hash of their contents, so each distinct module
+// is compiled once per process no matter how many scripts include it or
+// under which path.
+struct ModuleCache_ {
+    pthread_mutex_t lock;
+    pthread_cond_t compiled;
+    Module* modules;
+};
+
+ObjFunction* compileModule(const char* source, Globals* globals, Symbols* symbols,
+        ModuleCache* modules, Module* module);
+
+ModuleCache* initModuleCache();
+void freeModuleCache(ModuleCache* cache);
+uint64_t hashSource(const char* source, size_t length);
+Module* requestModule(ModuleCache* cache, const char* path, bool background);
+bool awaitModule(ModuleCache* cache, Module* module, Module* self);
+void prefetchIncludes(ModuleCache* cache, const char* source);
+const char* linkModule(Module* module, Globals* globals, Symbols* symbols, ObjFunction** linked);
+
+ModuleCache* initModuleCache() {
+    ModuleCache* cache = malloc(sizeof(ModuleCache));
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->compiled, NULL);
+    cache->modules = NULL;
+    return cache;
+}
+
+void freeModuleCache(ModuleCache* cache) {
+    pthread_mutex_lock(&cache->lock);
+    while (cache->modules != NULL) {
+        while (!cache->modules->ready) {
+            pthread_cond_wait(&cache->compiled, &cache->lock);
+        }
+        Module* module = cache->modules;
+        cache->modules = module->next;
+        freeGlobals(module->globals);
+        freeSymbols(module->symbols);
+        free(module->source);
+        free(module);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->compiled);
+    free(cache);
+}
+
+// 64-bit FNV-1a.
+uint64_t hashSource(const char* source, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)source[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static char* readModuleSource(const char* path, size_t* length) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    fseek(file, 0L, SEEK_END);
+    size_t fileSize = ftell(file);
+    rewind(file);
+    char* buffer = calloc(fileSize + 1, sizeof(char));
+    if (buffer == NULL || fread(buffer, sizeof(char), fileSize, file) < fileSize) {
+        free(buffer);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    *length = fileSize;
+    return buffer;
+}
+
+static void* compileModuleWorker(void* arg) {
+    Module* module = (Module*)arg;
+    ObjFunction* function = compileModule(module->source, module->globals, module->symbols,
+            module->cache, module);
+    pthread_mutex_lock(&module->cache->lock);
+    module->function = function;
+    module->ready = true;
+    pthread_cond_broadcast(&module->cache->compiled);
+    pthread_mutex_unlock(&module->cache->lock);
+    return NULL;
+}
+
+// Returns the cache entry for the file at path, starting its compilation
+// if this content has not been seen before: on a detached worker thread
+// when background is set, otherwise on the calling thread. Returns NULL if
+// the file can't be read.
+Module* requestModule(ModuleCache* cache, const char* path, bool background) {
+    size_t length;
+    char* source = readModuleSource(path, &length);
+    if (source == NULL) {
+        return NULL;
+    }
+    uint64_t hash = hashSource(source, length);
+    pthread_mutex_lock(&cache->lock);
+    for (Module* module = cache->modules; module != NULL; module = module->next) {
+        if (module->hash == hash && module->length == length &&
+            memcmp(module->source, source, length) == 0) {
+            pthread_mutex_unlock(&cache->lock);
+            free(source);
+            return module;
+        }
+    }
+    Module* module = malloc(sizeof(Module));
+    module->hash = hash;
+    module->length = length;
+    module->source = source;
+    module->function = NULL;
+    module->globals = initGlobals();
+    module->symbols = initSymbols();
+    module->cache = cache;
+    module->ready = false;
+    module->waitingOn = NULL;
+    module->next = cache->modules;
+    cache->modules = module;
+    pthread_mutex_unlock(&cache->lock);
+
+    pthread_t thread;
+    if (background && pthread_create(&thread, NULL, compileModuleWorker, module) == 0) {
+        pthread_detach(thread);
+    }
+    else {
+        compileModuleWorker(module);
+    }
+    return module;
+}
+
+// Blocks until the module is compiled. self is the module whose compilation
+// is waiting (NULL for a top-level script); returns false instead of
+// deadlocking when the wait would close an include cycle.
+bool awaitModule(ModuleCache* cache, Module* module, Module* self) {
+    pthread_mutex_lock(&cache->lock);
+    if (!module->ready) {
+        for (Module* waiting = module; waiting != NULL; waiting = waiting->waitingOn) {
+            if (waiting == self) {
+                pthread_mutex_unlock(&cache->lock);
+                return false;
+            }
+        }
+        if (self != NULL) {
+            self->waitingOn = module;
+        }
+        while (!module->ready) {
+            pthread_cond_wait(&cache->compiled, &cache->lock);
+        }
+        if (self != NULL) {
+            self->waitingOn = NULL;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return true;
+}
+
+// Skims the source for include statements and starts compiling every
+// included module in the background, so independent modules compile in
+// parallel while the includer itself is still being compiled.
+void prefetchIncludes(ModuleCache* cache, const char* source) {
+    Tokenizer* tokenizer = initTokenizer(source);
+    Token* previous = NULL;
+    for (;;) {
+        Token* token = scanToken(tokenizer);
+        if (token->type == TOKEN_STRING && previous != NULL && previous->type == TOKEN_INCLUDE) {
+            char* path = copyName(token->start + 1, token->length - 2);
+            requestModule(cache, path, true);
+            free(path);
+        }
+        free(previous);
+        previous = token;
+        if (token->type == TOKEN_EOF) {
+            break;
+        }
+    }
+    free(previous);
+    free(tokenizer);
+}
+
+static ObjFunction* relocateFunction(ObjFunction* function, int* slots, int* symbols);
+
+static ObjStruct* relocateStruct(ObjStruct* shape, int* symbols) {
+    ObjStruct* copy = newStruct(copyName(shape->name, (int)strlen(shape->name)));
+    for (int i = 0; i < shape->fieldCount; i++) {
+        addStructField(copy, (uint16_t)symbols[shape->fields[i]]);
+    }
+    return copy;
+}
+
+static Chunk* relocateChunk(Chunk* chunk, int* slots, int* symbols) {
+    Chunk* copy = initChunk();
+    for (int offset = 0; offset < chunk->count; offset++) {
+        writeChunk(copy, chunk->code[offset], chunk->lines[offset]);
+    }
+    for (int offset = 0; offset < copy->count; offset += instructionSize(copy->code[offset])) {
+        uint8_t instruction = copy->code[offset];
+        if (instruction == OP_GET_GLOBAL || instruction == OP_SET_GLOBAL) {
+            int slot = slots[(copy->code[offset + 1] << 8) | copy->code[offset + 2]];
+            copy->code[offset + 1] = (slot >> 8) & 0xff;
+            copy->code[offset + 2] = slot & 0xff;
+        }
+    }
+    for (int i = 0; i < chunk->constants->count; i++) {
+        Value constant = chunk->constants->values[i];
+        if (IS_FUNCTION(constant)) {
+            constant = OBJ_VAL(relocateFunction(AS_FUNCTION(constant), slots, symbols));
+        }
+        else if (IS_STRUCT(constant)) {
+            constant = OBJ_VAL(relocateStruct(AS_STRUCT(constant), symbols));
+        }
+        writeValueArray(copy->constants, constant);
+    }
+    for (int i = 0; i < chunk->cacheCount; i++) {
+        addInlineCache(copy, (uint16_t)symbols[chunk->caches[i].symbol]);
+    }
+    for (int i = 0; i < chunk->loopCount; i++) {
+        addLoop(copy, chunk->loops[i].header);
+    }
+    for (int i = 0; i < chunk->tableCount; i++) {
+        int index = addJumpTable(copy);
+        JumpTable* table = &copy->tables[index];
+        *table = chunk->tables[i];
+        table->targets = malloc(sizeof(int) * table->count);
+        memcpy(table->targets, chunk->tables[i].targets, sizeof(int) * table->count);
+        if (chunk->tables[i].keys != NULL) {
+            table->keys = malloc(sizeof(Value) * table->count);
+            memcpy(table->keys, chunk->tables[i].keys, sizeof(Value) * table->count);
+        }
+    }
+    for (int i = 0; i < chunk->handlerCount; i++) {
+        Handler* handler = &chunk->handlers[i];
+        addHandler(copy, handler->start, handler->end, handler->target, handler->depth);
+    }
+    return copy;
+}
+
+static ObjFunction* relocateFunction(ObjFunction* function, int* slots, int* symbols) {
+    ObjFunction* copy = newFunction();
+    copy->arity = function->arity;
+    if (function->name != NULL) {
+        copy->name = copyName(function->name, (int)strlen(function->name));
+    }
+    if (function->paramTypes != NULL) {
+        copy->paramTypes = malloc(UINT8_COUNT);
+        memcpy(copy->paramTypes, function->paramTypes, UINT8_COUNT);
+    }
+    freeChunk(copy->chunk);
+    if (function->chunk == NULL) {
+        // Not compiled yet; it will be compiled against the includer's tables.
+        copy->chunk = NULL;
+        copy->source = function->source;
+        copy->line = function->line;
+    }
+    else {
+        copy->chunk = relocateChunk(function->chunk, slots, symbols);
+    }
+    return copy;
+}
+
+// Links a compiled module into the given tables. On success *linked is the
+// relocated top-level function to run, or NULL if the module was already
+// linked into these tables; on failure the error message is returned.
+const char* linkModule(Module* module, Globals* globals, Symbols* symbols, ObjFunction** linked) {
+    *linked = NULL;
+    char marker[32];
+    snprintf(marker, sizeof(marker), "#module %p", (void*)module);
+    if (findGlobal(globals, marker, (int)strlen(marker)) != -1) {
+        return NULL;
+    }
+    Globals* from = module->globals;
+    if (globals->count + from->count + 1 > GLOBALS_MAX) {
+        return "Too many global variables.";
+    }
+    int* slots = malloc(sizeof(int) * (from->count + 1));
+    for (int i = 0; i < from->count; i++) {
+        int length = (int)strlen(from->names[i]);
+        int slot = findGlobal(globals, from->names[i], length);
+        if (slot == -1) {
+            slot = addGlobal(globals, from->names[i], length);
+        }
+        if (globals->kinds[slot] != from->kinds[i] || globals->types[slot] != from->types[i]) {
+            // The module's code and the includer's were each compiled
+            // against their own type for the slot, so they can only share
+            // it if the includer hasn't used it yet.
+            if (globals->used[slot] ||
+                (!IS_UNDEFINED(globals->values[slot]) && !IS_NATIVE(globals->values[slot]))) {
+                free(slots);
+                return "Module redeclares a global with a different kind or type.";
+            }
+            globals->kinds[slot] = from->kinds[i];
+            globals->types[slot] = from->types[i];
+            if (from->kinds[i] != GLOBAL_VARIABLE) {
+                globals->values[slot] = from->values[i];
+            }
+            else if (IS_NATIVE(globals->values[slot])) {
+                globals->values[slot] = UNDEFINED_VAL;
+            }
+        }
+        globals->used[slot] = globals->used[slot] || from->used[i];
+        slots[i] = slot;
+    }
+    int* symbolMap = malloc(sizeof(int) * (module->symbols->count + 1));
+    for (int i = 0; i < module->symbols->count; i++) {
+        const char* name = module->symbols->names[i];
+        symbolMap[i] = internSymbol(symbols, name, (int)strlen(name));
+        if (symbolMap[i] == -1) {
+            free(slots);
+            free(symbolMap);
+            return "Too many field names.";
+        }
+    }
+    int markerSlot = addGlobal(globals, marker, (int)strlen(marker));
+    globals->kinds[markerSlot] = GLOBAL_CONSTANT;
+    globals->values[markerSlot] = NIL_VAL;
+    *linked = relocateFunction(module->function, slots, symbolMap);
+    free(slots);
+    free(symbolMap);
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,257 @@
+#ifndef object_h
+#define object_h
+
+#include <string.h>
+#include "common.h"
+#include "chunk.h"
+#include "value.h"
+
+#define OBJ_TYPE(value) (AS_OBJ(value)->type)
+
+#define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
+#define IS_STRUCT(value) isObjType(value, OBJ_STRUCT)
+#define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
+#define IS_VECTOR(value) isObjType(value, OBJ_VECTOR)
+#define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_STRING(value) isObjType(value, OBJ_STRING)
+
+#define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
+#define AS_STRUCT(value) ((ObjStruct*)AS_OBJ(value))
+#define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
+#define AS_VECTOR(value) ((ObjVector*)AS_OBJ(value))
+#define AS_NATIVE(value) ((ObjNative*)AS_OBJ(value))
+#define AS_STRING(value) ((ObjString*)AS_OBJ(value))
+
+enum ObjType_ {
+    OBJ_FUNCTION,
+    OBJ_STRUCT,
+    OBJ_INSTANCE,
+    OBJ_VECTOR,
+    OBJ_NATIVE,
+    OBJ_STRING
+};
+typedef enum ObjType_ ObjType;
+
+struct Obj_ {
+    ObjType type;
+};
+
+// paramTypes is NULL unless some parameter has a declared type, in which
+// case calls check the arguments once on entry. A function whose body has
+// only been skimmed has no chunk yet; source and line locate its
+// declaration (from the name on) for compiling it on first call.
+struct ObjFunction_ {
+    Obj obj;
+    int arity;
+    Chunk* chunk;
+    char* name;
+    uint8_t* paramTypes;
+    const char* source;
+    int line;
+};
+typedef struct ObjFunction_ ObjFunction;
+
+// A struct declaration doubles as the shape (hidden class) of its
+// instances: it fixes the field layout once, by interned field symbol.
+struct ObjStruct_ {
+    Obj obj;
+    char* name;
+    int fieldCount;
+    uint16_t* fields;
+};
+typedef struct ObjStruct_ ObjStruct;
+
+// Instances carry only their shape and the field values, inline.
+struct ObjInstance_ {
+    Obj obj;
+    ObjStruct* shape;
+    Value fields[];
+};
+typedef struct ObjInstance_ ObjInstance;
+
+// A fixed-length vector of reals, stored unboxed and contiguously so
+// arithmetic on it can run as one SIMD loop.
+struct ObjVector_ {
+    Obj obj;
+    int count;
+    double elements[];
+};
+typedef struct ObjVector_ ObjVector;
+
+// A built-in function. It reads its arguments and stores its result, or
+// returns an error message for the VM to report.
+typedef const char* (*NativeFn)(Value* args, Value* result);
+
+struct ObjNative_ {
+    Obj obj;
+    const char* name;
+    int arity;
+    NativeFn function;
+};
+typedef struct ObjNative_ ObjNative;
+
+// An immutable string, used for string literals and error messages.
+// Strings compare equal by content.
+struct ObjString_ {
+    Obj obj;
+    int length;
+    char chars[];
+};
+typedef struct ObjString_ ObjString;
+
+Obj* allocateObject(size_t size, ObjType type);
+ObjFunction* newFunction();
+ObjFunction* newLazyFunction(char* name, const char* source, int line);
+char* copyName(const char* start, int length);
+ObjStruct* newStruct(char* name);
+void addStructField(ObjStruct* shape, uint16_t symbol);
+int findField(ObjStruct* shape, uint16_t symbol);
+ObjInstance* newInstance(ObjStruct* shape);
+ObjVector* newVector(int count);
+ObjNative* newNative(const char* name, int arity, NativeFn function);
+ObjString* copyString(const char* chars, int length);
+
+static inline bool isObjType(Value value, ObjType type) {
+    return IS_OBJ(value) && AS_OBJ(value)->type == type;
+}
+
+Obj* allocateObject(size_t size, ObjType type) {
+    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    object->type = type;
+    return object;
+}
+
+ObjFunction* newFunction() {
+    ObjFunction* function = (ObjFunction*)allocateObject(sizeof(ObjFunction), OBJ_FUNCTION);
+    function->arity = 0;
+    function->chunk = initChunk();
+    function->name = NULL;
+    function->paramTypes = NULL;
+    function->source = NULL;
+    function->line = 0;
+    return function;
+}
+
+ObjFunction* newLazyFunction(char* name, const char* source, int line) {
+    ObjFunction* function = (ObjFunction*)allocateObject(sizeof(ObjFunction), OBJ_FUNCTION);
+    function->arity = 0;
+    function->chunk = NULL;
+    function->name = name;
+    function->paramTypes = NULL;
+    function->source = source;
+    function->line = line;
+    return function;
+}
+
+char* copyName(const char* start, int length) {
+    char* name = malloc(length + 1);
+    memcpy(name, start, length);
+    name[length] = '\0';
+    return name;
+}
+
+ObjStruct* newStruct(char* name) {
+    ObjStruct* shape = (ObjStruct*)allocateObject(sizeof(ObjStruct), OBJ_STRUCT);
+    shape->name = name;
+    shape->fieldCount = 0;
+    shape->fields = NULL;
+    return shape;
+}
+
+void addStructField(ObjStruct* shape, uint16_t symbol) {
+    shape->fields = grow_array(shape->fields, uint16_t, shape->fieldCount,
+            shape->fieldCount + 1);
+    shape->fields[shape->fieldCount++] = symbol;
+}
+
+int findField(ObjStruct* shape, uint16_t symbol) {
+    for (int i = 0; i < shape->fieldCount; i++) {
+        if (shape->fields[i] == symbol) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+ObjInstance* newInstance(ObjStruct* shape) {
+    ObjInstance* instance = (ObjInstance*)allocateObject(
+            sizeof(ObjInstance) + sizeof(Value) * shape->fieldCount, OBJ_INSTANCE);
+    instance->shape = shape;
+    for (int i = 0; i < shape->fieldCount; i++) {
+        instance->fields[i] = NIL_VAL;
+    }
+    return instance;
+}
+
+// The elements are left uninitialized for the caller to fill.
+ObjVector* newVector(int count) {
+    ObjVector* vector = (ObjVector*)allocateObject(
+            sizeof(ObjVector) + sizeof(double) * count, OBJ_VECTOR);
+    vector->count = count;
+    return vector;
+}
+
+ObjNative* newNative(const char* name, int arity, NativeFn function) {
+    ObjNative* native = (ObjNative*)allocateObject(sizeof(ObjNative), OBJ_NATIVE);
+    native->name = name;
+    native->arity = arity;
+    native->function = function;
+    return native;
+}
+
+ObjString* copyString(const char* chars, int length) {
+    ObjString* string = (ObjString*)allocateObject(
+            sizeof(ObjString) + length + 1, OBJ_STRING);
+    string->length = length;
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
+    return string;
+}
+
+bool objectsEqual(Value a, Value b) {
+    if (!IS_STRING(a) || !IS_STRING(b)) {
+        return false;
+    }
+    ObjString* first = AS_STRING(a);
+    ObjString* second = AS_STRING(b);
+    return first->length == second->length &&
+        memcmp(first->chars, second->chars, first->length) == 0;
+}
+
+void writeObject(FILE* file, Value value) {
+    switch (OBJ_TYPE(value)) {
+        case OBJ_FUNCTION: {
+            ObjFunction* function = AS_FUNCTION(value);
+            if (function->name == NULL) {
+                fprintf(file, "<script>");
+            }
+            else {
+                fprintf(file, "<fn %s>", function->name);
+            }
+            break;
+        }
+        case OBJ_STRUCT:
+            fprintf(file, "<struct %s>", AS_STRUCT(value)->name);
+            break;
+        case OBJ_INSTANCE:
+            fprintf(file, "<%s instance>", AS_INSTANCE(value)->shape->name);
+            break;
+        case OBJ_VECTOR: {
+            ObjVector* vector = AS_VECTOR(value);
+            fprintf(file, "[");
+            for (int i = 0; i < vector->count; i++) {
+                fprintf(file, i > 0 ? ", %g" : "%g", vector->elements[i]);
+            }
+            fprintf(file, "]");
+            break;
+        }
+        case OBJ_NATIVE:
+            fprintf(file, "<native %s>", AS_NATIVE(value)->name);
+            break;
+        case OBJ_STRING:
+            fwrite(AS_STRING(value)->chars, 1, AS_STRING(value)->length, file);
+            break;
+    }
+}
+
+#endif
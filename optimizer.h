@@ -0,0 +1,465 @@
+#ifndef optimizer_h
+#define optimizer_h
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "chunk.h"
+#include "debug.h"
+#include "value.h"
+
+// Back-edges a loop takes before its chunk is optimized.
+#define HOT_LOOP_THRESHOLD 1000
+// Deoptimizations after which a chunk stays in the baseline tier.
+#define DEOPT_LIMIT 4
+
+// One instruction of a chunk being optimized. offset is the baseline offset
+// it stands for: the optimized code may be entered there, and resumes there
+// if the instruction deoptimizes. Folded and fused instructions stand for
+// the first baseline instruction they replace. elided instructions emit
+// nothing; their offset maps to whatever follows. loop is the counter index
+// of an OP_LOOP_LT.
+struct Instr_ {
+    int offset;
+    uint8_t op;
+    uint8_t binary;
+    int a;
+    int b;
+    int target;
+    int loop;
+    bool elided;
+};
+typedef struct Instr_ Instr;
+
+Chunk* optimizeChunk(Chunk* baseline);
+
+static int readShort(Chunk* chunk, int offset) {
+    return (chunk->code[offset] << 8) | chunk->code[offset + 1];
+}
+
+static bool isBinary(uint8_t op) {
+    switch (op) {
+        case OP_ADD: case OP_SUB: case OP_MULT: case OP_DIV:
+        case OP_LESS: case OP_GREATER: case OP_EQUAL:
+        case OP_ADD_REAL: case OP_SUB_REAL: case OP_MULT_REAL: case OP_DIV_REAL:
+        case OP_LESS_REAL: case OP_GREATER_REAL: case OP_EQUAL_REAL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Fused instructions check their operand types themselves, so the typed
+// and untyped forms of an operator fuse the same way.
+static uint8_t genericBinary(uint8_t op) {
+    switch (op) {
+        case OP_ADD_REAL: return OP_ADD;
+        case OP_SUB_REAL: return OP_SUB;
+        case OP_MULT_REAL: return OP_MULT;
+        case OP_DIV_REAL: return OP_DIV;
+        case OP_LESS_REAL: return OP_LESS;
+        case OP_GREATER_REAL: return OP_GREATER;
+        case OP_EQUAL_REAL: return OP_EQUAL;
+        default: return op;
+    }
+}
+
+static Value foldBinary(uint8_t op, double a, double b) {
+    switch (genericBinary(op)) {
+        case OP_ADD: return NUMBER_VAL(a + b);
+        case OP_SUB: return NUMBER_VAL(a - b);
+        case OP_MULT: return NUMBER_VAL(a * b);
+        case OP_DIV: return NUMBER_VAL(a / b);
+        case OP_LESS: return BOOL_VAL(a < b);
+        case OP_GREATER: return BOOL_VAL(a > b);
+        default: return BOOL_VAL(a == b);
+    }
+}
+
+static bool isConstant(Instr* instr) {
+    return instr->op == OP_CONSTANT || instr->op == OP_CONSTANT_LONG;
+}
+
+static bool isNumberConstant(Chunk* chunk, Instr* instr) {
+    return isConstant(instr) && IS_NUMBER(chunk->constants->values[instr->a]);
+}
+
+// The value a constant-pushing instruction pushes, if it is one.
+static bool knownValue(Chunk* chunk, Instr* instr, Value* value) {
+    switch (instr->op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG: *value = chunk->constants->values[instr->a]; return true;
+        case OP_TRUE: *value = BOOL_VAL(true); return true;
+        case OP_FALSE: *value = BOOL_VAL(false); return true;
+        case OP_NIL: *value = NIL_VAL; return true;
+        default: return false;
+    }
+}
+
+static int decodeChunk(Chunk* chunk, Instr* code, bool* targets) {
+    int count = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionSize(chunk->code[offset])) {
+        Instr* instr = &code[count++];
+        instr->offset = offset;
+        instr->op = chunk->code[offset];
+        instr->binary = 0;
+        instr->a = 0;
+        instr->b = 0;
+        instr->target = -1;
+        instr->loop = 0;
+        instr->elided = false;
+        switch (instructionSize(instr->op)) {
+            case 2: instr->a = chunk->code[offset + 1]; break;
+            case 3: instr->a = readShort(chunk, offset + 1); break;
+        }
+        switch (instr->op) {
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+                instr->target = offset + 3 + instr->a;
+                targets[instr->target] = true;
+                // Branches that leave their condition for a POP at the
+                // target may be fused to pop it themselves and skip it.
+                if (instr->op == OP_JUMP_IF_FALSE && chunk->code[instr->target] == OP_POP) {
+                    targets[instr->target + 1] = true;
+                }
+                break;
+            case OP_LOOP:
+                instr->a = readShort(chunk, offset + 1);
+                instr->target = offset + 5 - instr->a;
+                targets[instr->target] = true;
+                break;
+            case OP_LESS_JUMP_IF_FALSE:
+                instr->target = offset + 3 + instr->a;
+                targets[instr->target] = true;
+                break;
+            case OP_INCR_LOCAL:
+                instr->a = chunk->code[offset + 1];
+                instr->b = chunk->code[offset + 2];
+                break;
+            case OP_LOOP_LT:
+                instr->a = chunk->code[offset + 1];
+                instr->b = chunk->code[offset + 2];
+                instr->target = offset + 7 - readShort(chunk, offset + 3);
+                instr->loop = readShort(chunk, offset + 5);
+                targets[instr->target] = true;
+                break;
+        }
+    }
+    for (int i = 0; i < chunk->tableCount; i++) {
+        JumpTable* table = &chunk->tables[i];
+        for (int j = 0; j < table->count; j++) {
+            targets[table->targets[j]] = true;
+        }
+        targets[table->defaultTarget] = true;
+    }
+    // Nothing may be fused across the edges of a try block's range.
+    for (int i = 0; i < chunk->handlerCount; i++) {
+        Handler* handler = &chunk->handlers[i];
+        targets[handler->start] = true;
+        targets[handler->end] = true;
+        targets[handler->target] = true;
+    }
+    return count;
+}
+
+// Every reoptimization folds again into the pool shared with the
+// baseline, so a folded number or bool reuses an equal constant instead of
+// adding one. Numbers must match bit for bit, which keeps 0 and -0 apart.
+static int foldedConstant(Chunk* chunk, Value value) {
+    ValueArray* constants = chunk->constants;
+    for (int i = 0; i < constants->count; i++) {
+        Value constant = constants->values[i];
+        if (constant.type != value.type) {
+            continue;
+        }
+        if (IS_BOOL(value) ? AS_BOOL(constant) == AS_BOOL(value) :
+                memcmp(&AS_NUMBER(constant), &AS_NUMBER(value), sizeof(double)) == 0) {
+            return i;
+        }
+    }
+    return addConstant(chunk, value);
+}
+
+// Constant propagation: folds arithmetic, negation and not over known
+// operands, and drops tests of conditions known to be true, such as the
+// one in while (true). Repeats until nothing changes so folds feed folds.
+static int foldConstants(Chunk* chunk, Instr* code, int count, bool* targets) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        int out = 0;
+        for (int i = 0; i < count; i++) {
+            Instr* instr = &code[i];
+            Value value;
+            if (instr->elided || chunk->constants->count > UINT16_MAX) {
+                code[out++] = *instr;
+                continue;
+            }
+            if (i + 2 < count && isNumberConstant(chunk, instr) &&
+                isNumberConstant(chunk, &code[i + 1]) && isBinary(code[i + 2].op) &&
+                !targets[code[i + 1].offset] && !targets[code[i + 2].offset] &&
+                !code[i + 1].elided && !code[i + 2].elided) {
+                double a = AS_NUMBER(chunk->constants->values[instr->a]);
+                double b = AS_NUMBER(chunk->constants->values[code[i + 1].a]);
+                Instr folded = *instr;
+                folded.op = OP_CONSTANT_LONG;
+                folded.a = foldedConstant(chunk, foldBinary(code[i + 2].op, a, b));
+                code[out++] = folded;
+                i += 2;
+                changed = true;
+                continue;
+            }
+            if (i + 1 < count && isNumberConstant(chunk, instr) &&
+                (code[i + 1].op == OP_NEGATE || code[i + 1].op == OP_NEGATE_REAL) &&
+                !targets[code[i + 1].offset] && !code[i + 1].elided) {
+                Instr folded = *instr;
+                folded.op = OP_CONSTANT_LONG;
+                folded.a = foldedConstant(chunk,
+                        NUMBER_VAL(-AS_NUMBER(chunk->constants->values[instr->a])));
+                code[out++] = folded;
+                i += 1;
+                changed = true;
+                continue;
+            }
+            if (i + 1 < count && (instr->op == OP_TRUE || instr->op == OP_FALSE) &&
+                code[i + 1].op == OP_NOT && !targets[code[i + 1].offset] && !code[i + 1].elided) {
+                Instr folded = *instr;
+                folded.op = instr->op == OP_TRUE ? OP_FALSE : OP_TRUE;
+                code[out++] = folded;
+                i += 1;
+                changed = true;
+                continue;
+            }
+            if (i + 2 < count && knownValue(chunk, instr, &value) &&
+                !IS_NIL(value) && !(IS_BOOL(value) && !AS_BOOL(value)) &&
+                code[i + 1].op == OP_JUMP_IF_FALSE && code[i + 2].op == OP_POP &&
+                !targets[code[i + 1].offset] && !targets[code[i + 2].offset]) {
+                for (int j = 0; j < 3; j++) {
+                    code[i + j].elided = true;
+                    code[out++] = code[i + j];
+                }
+                i += 2;
+                changed = true;
+                continue;
+            }
+            code[out++] = *instr;
+        }
+        count = out;
+    }
+    return count;
+}
+
+static bool fusable(Instr* code, int i, int length, int count, bool* targets) {
+    if (i + length > count) {
+        return false;
+    }
+    for (int j = 0; j < length; j++) {
+        if (code[i + j].elided || (j > 0 && targets[code[i + j].offset])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Superinstructions and specialization: a load of a local or global
+// followed by a load of another or of a numeric constant, followed by an
+// arithmetic or comparison operator, becomes one instruction that works
+// on numbers directly and deoptimizes otherwise. Stores followed by a pop
+// and conditional branches followed by a pop become single instructions.
+// Sites that deoptimized before are left generic.
+static int fuseInstructions(Chunk* chunk, Instr* code, int count, bool* targets) {
+    int out = 0;
+    for (int i = 0; i < count; i++) {
+        Instr* instr = &code[i];
+        Instr fused = *instr;
+        bool stable = !chunk->unstable[instr->offset];
+        if (stable && fusable(code, i, 3, count, targets) && isBinary(code[i + 2].op) &&
+            (instr->op == OP_GET_LOCAL || instr->op == OP_GET_GLOBAL) &&
+            (code[i + 1].op == instr->op || isNumberConstant(chunk, &code[i + 1]))) {
+            bool local = instr->op == OP_GET_LOCAL;
+            if (isConstant(&code[i + 1])) {
+                fused.op = local ? OP_BINARY_LK : OP_BINARY_GK;
+            }
+            else {
+                fused.op = local ? OP_BINARY_LL : OP_BINARY_GG;
+            }
+            fused.binary = genericBinary(code[i + 2].op);
+            fused.b = code[i + 1].a;
+            code[out++] = fused;
+            i += 2;
+            continue;
+        }
+        if (fusable(code, i, 2, count, targets) && code[i + 1].op == OP_POP) {
+            if (instr->op == OP_SET_LOCAL || instr->op == OP_SET_GLOBAL) {
+                fused.op = instr->op == OP_SET_LOCAL ? OP_SET_LOCAL_POP : OP_SET_GLOBAL_POP;
+                code[out++] = fused;
+                i += 1;
+                continue;
+            }
+            if (instr->op == OP_JUMP_IF_FALSE && chunk->code[instr->target] == OP_POP) {
+                fused.op = OP_JUMP_IF_FALSE_POP;
+                fused.target = instr->target + 1;
+                code[out++] = fused;
+                i += 1;
+                continue;
+            }
+        }
+        if (instr->op == OP_LOOP) {
+            fused.op = OP_JUMP_BACK;
+        }
+        code[out++] = fused;
+    }
+    return out;
+}
+
+static void emitOptimized(Chunk* chunk, Instr* instr, int line) {
+    writeChunk(chunk, instr->op, line);
+    switch (instr->op) {
+        case OP_CONSTANT_LONG:
+            if (instr->a <= UINT8_MAX) {
+                chunk->code[chunk->count - 1] = OP_CONSTANT;
+                writeChunk(chunk, (uint8_t)instr->a, line);
+                return;
+            }
+            break;
+        case OP_BINARY_LL:
+            writeChunk(chunk, instr->binary, line);
+            writeChunk(chunk, (uint8_t)instr->a, line);
+            writeChunk(chunk, (uint8_t)instr->b, line);
+            return;
+        case OP_BINARY_LK:
+            writeChunk(chunk, instr->binary, line);
+            writeChunk(chunk, (uint8_t)instr->a, line);
+            writeChunk(chunk, (instr->b >> 8) & 0xff, line);
+            writeChunk(chunk, instr->b & 0xff, line);
+            return;
+        case OP_BINARY_GG:
+        case OP_BINARY_GK:
+            writeChunk(chunk, instr->binary, line);
+            writeChunk(chunk, (instr->a >> 8) & 0xff, line);
+            writeChunk(chunk, instr->a & 0xff, line);
+            writeChunk(chunk, (instr->b >> 8) & 0xff, line);
+            writeChunk(chunk, instr->b & 0xff, line);
+            return;
+        case OP_INCR_LOCAL:
+            writeChunk(chunk, (uint8_t)instr->a, line);
+            writeChunk(chunk, (uint8_t)instr->b, line);
+            return;
+        case OP_LOOP_LT:
+            writeChunk(chunk, (uint8_t)instr->a, line);
+            writeChunk(chunk, (uint8_t)instr->b, line);
+            writeChunk(chunk, 0xff, line);
+            writeChunk(chunk, 0xff, line);
+            writeChunk(chunk, (instr->loop >> 8) & 0xff, line);
+            writeChunk(chunk, instr->loop & 0xff, line);
+            return;
+    }
+    switch (instructionSize(instr->op)) {
+        case 2:
+            writeChunk(chunk, (uint8_t)instr->a, line);
+            break;
+        case 3:
+            writeChunk(chunk, (instr->a >> 8) & 0xff, line);
+            writeChunk(chunk, instr->a & 0xff, line);
+            break;
+    }
+}
+
+// Builds the optimized tier of a baseline chunk. Constants and inline
+// caches are shared with the baseline; jumps, match tables and exception
+// handlers are retargeted to the new offsets. Counted loops keep their fused
+// back-edge, with counters that start too cold to ever get hot. Returns NULL if the rewritten code
+// can't be encoded.
+Chunk* optimizeChunk(Chunk* baseline) {
+    if (baseline->unstable == NULL) {
+        baseline->unstable = calloc(baseline->count + 1, sizeof(bool));
+    }
+    bool* targets = calloc(baseline->count + 2, sizeof(bool));
+    Instr* code = malloc(sizeof(Instr) * (baseline->count + 1));
+    int count = decodeChunk(baseline, code, targets);
+    count = foldConstants(baseline, code, count, targets);
+    count = fuseInstructions(baseline, code, count, targets);
+
+    Chunk* chunk = initChunk();
+    free(chunk->constants);
+    chunk->constants = baseline->constants;
+    chunk->caches = baseline->caches;
+    chunk->cacheCount = baseline->cacheCount;
+    chunk->cacheCapacity = baseline->cacheCapacity;
+    chunk->baseline = baseline;
+    for (int i = 0; i < baseline->loopCount; i++) {
+        int index = addLoop(chunk, baseline->loops[i].header);
+        chunk->loops[index].hotness = INT_MIN;
+    }
+    chunk->entries = malloc(sizeof(int) * (baseline->count + 1));
+    for (int i = 0; i <= baseline->count; i++) {
+        chunk->entries[i] = -1;
+    }
+    int* starts = malloc(sizeof(int) * (count + 1));
+    for (int i = 0; i < count; i++) {
+        starts[i] = chunk->count;
+        chunk->entries[code[i].offset] = chunk->count;
+        if (!code[i].elided) {
+            emitOptimized(chunk, &code[i], baseline->lines[code[i].offset]);
+        }
+    }
+    chunk->entries[baseline->count] = chunk->count;
+    chunk->resume = malloc(sizeof(int) * (chunk->count + 1));
+    for (int i = 0; i < count; i++) {
+        chunk->resume[starts[i]] = code[i].offset;
+    }
+
+    bool encoded = true;
+    for (int i = 0; i < count && encoded; i++) {
+        Instr* instr = &code[i];
+        if (instr->target == -1 || instr->elided) {
+            continue;
+        }
+        int target = chunk->entries[instr->target];
+        int next = starts[i] + instructionSize(instr->op);
+        bool back = instr->op == OP_JUMP_BACK || instr->op == OP_LOOP_LT;
+        int jump = back ? next - target : target - next;
+        if (target == -1 || jump < 0 || jump > UINT16_MAX) {
+            encoded = false;
+            break;
+        }
+        // OP_LOOP_LT has its two slots ahead of the jump.
+        int operand = starts[i] + (instr->op == OP_LOOP_LT ? 3 : 1);
+        chunk->code[operand] = (jump >> 8) & 0xff;
+        chunk->code[operand + 1] = jump & 0xff;
+    }
+    for (int i = 0; i < baseline->tableCount && encoded; i++) {
+        int index = addJumpTable(chunk);
+        JumpTable* table = &chunk->tables[index];
+        *table = baseline->tables[i];
+        table->targets = malloc(sizeof(int) * table->count);
+        for (int j = 0; j < table->count; j++) {
+            table->targets[j] = chunk->entries[baseline->tables[i].targets[j]];
+            encoded = encoded && table->targets[j] != -1;
+        }
+        table->defaultTarget = chunk->entries[baseline->tables[i].defaultTarget];
+        encoded = encoded && table->defaultTarget != -1;
+    }
+    for (int i = 0; i < baseline->handlerCount && encoded; i++) {
+        Handler* handler = &baseline->handlers[i];
+        int start = chunk->entries[handler->start];
+        int end = chunk->entries[handler->end];
+        int target = chunk->entries[handler->target];
+        encoded = start != -1 && end != -1 && target != -1;
+        addHandler(chunk, start, end, target, handler->depth);
+    }
+    free(targets);
+    free(code);
+    free(starts);
+    if (!encoded) {
+        freeChunk(chunk);
+        return NULL;
+    }
+#ifdef DEBUG_PRINT_CODE
+    disassembleChunk(chunk, "<optimized>");
+#endif
+    return chunk;
+}
+
+#endif
@@ -0,0 +1,208 @@
+#ifndef profiler_h
+#define profiler_h
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// Microseconds of CPU time between samples.
+#ifndef PROFILE_INTERVAL
+#define PROFILE_INTERVAL 1000
+#endif
+// Distinct stacks and total frames the profiler can hold; samples of new
+// stacks past either limit are only counted as dropped.
+#define PROFILE_STACKS_MAX 16384
+#define PROFILE_FRAMES_MAX (1 << 20)
+
+// One frame of a sampled stack: the function and the source line it was
+// at. A NULL function stands for the script's top level.
+struct ProfileFrame_ {
+    ObjFunction* function;
+    int line;
+};
+typedef struct ProfileFrame_ ProfileFrame;
+
+// A distinct stack, outermost frame first, and how often it was sampled.
+struct ProfileStack_ {
+    uint64_t hash;
+    int start;
+    int depth;
+    long count;
+};
+typedef struct ProfileStack_ ProfileStack;
+
+// Samples are aggregated by stack as they are taken, in tables allocated
+// up front: the SIGPROF handler only reads the VM's frames and writes
+// here, never allocating or calling into the VM. index is an
+// open-addressed hash of stacks (entries are stack numbers plus one).
+struct Profiler_ {
+    VM* vm;
+    ProfileStack* stacks;
+    int stackCount;
+    int* index;
+    ProfileFrame* frames;
+    int frameCount;
+    long dropped;
+    long outside;
+    volatile sig_atomic_t busy;
+    struct sigaction previous;
+};
+typedef struct Profiler_ Profiler;
+
+Profiler* initProfiler(VM* vm);
+void freeProfiler(Profiler* profiler);
+void startProfiler(Profiler* profiler);
+void stopProfiler(Profiler* profiler);
+void writeFoldedStacks(Profiler* profiler, FILE* file);
+
+static Profiler* activeProfiler = NULL;
+
+Profiler* initProfiler(VM* vm) {
+    Profiler* profiler = malloc(sizeof(Profiler));
+    profiler->vm = vm;
+    profiler->stacks = malloc(sizeof(ProfileStack) * PROFILE_STACKS_MAX);
+    profiler->stackCount = 0;
+    profiler->index = calloc(PROFILE_STACKS_MAX * 2, sizeof(int));
+    profiler->frames = malloc(sizeof(ProfileFrame) * PROFILE_FRAMES_MAX);
+    profiler->frameCount = 0;
+    profiler->dropped = 0;
+    profiler->outside = 0;
+    profiler->busy = 0;
+    return profiler;
+}
+
+void freeProfiler(Profiler* profiler) {
+    free(profiler->stacks);
+    free(profiler->index);
+    free(profiler->frames);
+    free(profiler);
+}
+
+// The line a frame is at. The handler can interrupt a call or a tier
+// switch halfway, so an ip outside the chunk yields line 0 rather than a
+// read out of bounds.
+static int sampleLine(Chunk* chunk, uint8_t* ip) {
+    if (chunk == NULL || ip <= chunk->code || ip > chunk->code + chunk->count) {
+        return 0;
+    }
+    return chunk->lines[ip - chunk->code - 1];
+}
+
+// Frames are compared field by field: the padding after line is never
+// written, so comparing their bytes could split one stack into several.
+static bool sameFrames(ProfileFrame* a, ProfileFrame* b, int depth) {
+    for (int i = 0; i < depth; i++) {
+        if (a[i].function != b[i].function || a[i].line != b[i].line) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void recordSample(Profiler* profiler) {
+    VM* vm = profiler->vm;
+    int depth = vm->frameCount;
+    if (depth <= 0 || depth > FRAMES_MAX) {
+        profiler->outside++;
+        return;
+    }
+    ProfileFrame sample[FRAMES_MAX];
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < depth; i++) {
+        CallFrame* frame = &vm->frames[i];
+        bool top = i == depth - 1;
+        sample[i].function = frame->function != NULL && frame->function->name != NULL ?
+            frame->function : NULL;
+        sample[i].line = sampleLine(top ? vm->chunk : frame->chunk, top ? vm->ip : frame->ip);
+        hash = (hash ^ (uintptr_t)sample[i].function) * 1099511628211ULL;
+        hash = (hash ^ (uint64_t)sample[i].line) * 1099511628211ULL;
+    }
+    int mask = PROFILE_STACKS_MAX * 2 - 1;
+    for (int slot = (int)(hash & mask);; slot = (slot + 1) & mask) {
+        int entry = profiler->index[slot];
+        if (entry == 0) {
+            if (profiler->stackCount == PROFILE_STACKS_MAX ||
+                profiler->frameCount + depth > PROFILE_FRAMES_MAX) {
+                profiler->dropped++;
+                return;
+            }
+            ProfileStack* stack = &profiler->stacks[profiler->stackCount];
+            stack->hash = hash;
+            stack->start = profiler->frameCount;
+            stack->depth = depth;
+            stack->count = 1;
+            memcpy(&profiler->frames[profiler->frameCount], sample, sizeof(ProfileFrame) * depth);
+            profiler->frameCount += depth;
+            profiler->index[slot] = ++profiler->stackCount;
+            return;
+        }
+        ProfileStack* stack = &profiler->stacks[entry - 1];
+        if (stack->hash == hash && stack->depth == depth &&
+            sameFrames(&profiler->frames[stack->start], sample, depth)) {
+            stack->count++;
+            return;
+        }
+    }
+}
+
+// SIGPROF is process-wide, so it may land on a module compiler thread;
+// busy keeps two handlers from updating the tables at once.
+static void profileSignal(int signal) {
+    Profiler* profiler = activeProfiler;
+    if (profiler == NULL || __atomic_exchange_n(&profiler->busy, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    recordSample(profiler);
+    __atomic_store_n(&profiler->busy, 0, __ATOMIC_RELEASE);
+}
+
+void startProfiler(Profiler* profiler) {
+    activeProfiler = profiler;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profileSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, &profiler->previous);
+    struct itimerval timer;
+    timer.it_interval.tv_sec = PROFILE_INTERVAL / 1000000;
+    timer.it_interval.tv_usec = PROFILE_INTERVAL % 1000000;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+void stopProfiler(Profiler* profiler) {
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    sigaction(SIGPROF, &profiler->previous, NULL);
+    activeProfiler = NULL;
+}
+
+// One line per distinct stack, frames outermost first and separated by
+// semicolons, then the sample count: the folded format flame graph tools
+// read. Frames are named function:line, with the top level as script.
+void writeFoldedStacks(Profiler* profiler, FILE* file) {
+    for (int i = 0; i < profiler->stackCount; i++) {
+        ProfileStack* stack = &profiler->stacks[i];
+        for (int j = 0; j < stack->depth; j++) {
+            ProfileFrame* frame = &profiler->frames[stack->start + j];
+            fprintf(file, "%s%s:%d", j > 0 ? ";" : "",
+                    frame->function != NULL ? frame->function->name : "script", frame->line);
+        }
+        fprintf(file, " %ld\n", stack->count);
+    }
+    if (profiler->outside > 0) {
+        fprintf(file, "(outside script) %ld\n", profiler->outside);
+    }
+    if (profiler->dropped > 0) {
+        fprintf(file, "(dropped) %ld\n", profiler->dropped);
+    }
+}
+
+#endif
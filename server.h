@@ -0,0 +1,321 @@
+#ifndef server_h
+#define server_h
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "common.h"
+#include "modules.h"
+#include "vm.h"
+
+// Compiled scripts a server keeps; 0 disables the cache.
+#ifndef SCRIPT_CACHE_SIZE
+#define SCRIPT_CACHE_SIZE 256
+#endif
+// Longest request source a server accepts, in bytes.
+#define REQUEST_MAX (16 * 1024 * 1024)
+
+// A compiled script, keyed by the hash of its source. The source is kept
+// to tell colliding hashes apart. Entries are chained per bucket and
+// linked in order of use, newest first.
+struct CachedScript_ {
+    uint64_t hash;
+    size_t length;
+    char* source;
+    ObjFunction* function;
+    struct CachedScript_* chain;
+    struct CachedScript_* newer;
+    struct CachedScript_* older;
+};
+typedef struct CachedScript_ CachedScript;
+
+// Least recently used scripts are evicted once capacity is reached.
+// Eviction only drops the cache's reference: with no collector, the
+// function may still be reachable from globals the script defined.
+struct ScriptCache_ {
+    int count;
+    int capacity;
+    int bucketCount;
+    CachedScript** buckets;
+    CachedScript* newest;
+    CachedScript* oldest;
+};
+typedef struct ScriptCache_ ScriptCache;
+
+ScriptCache* initScriptCache(int capacity);
+void freeScriptCache(ScriptCache* cache);
+ObjFunction* compileCached(VM* vm, ScriptCache* cache, const char* source, size_t length);
+bool serveRequests(VM* vm, ScriptCache* cache, int in, int out);
+bool serveSocket(VM* vm, ScriptCache* cache, const char* path);
+bool serve(VM* vm, const char* path);
+
+ScriptCache* initScriptCache(int capacity) {
+    ScriptCache* cache = malloc(sizeof(ScriptCache));
+    cache->count = 0;
+    cache->capacity = capacity;
+    cache->bucketCount = 8;
+    while (cache->bucketCount < capacity) {
+        cache->bucketCount *= 2;
+    }
+    cache->buckets = calloc(cache->bucketCount, sizeof(CachedScript*));
+    cache->newest = NULL;
+    cache->oldest = NULL;
+    return cache;
+}
+
+void freeScriptCache(ScriptCache* cache) {
+    CachedScript* script = cache->newest;
+    while (script != NULL) {
+        CachedScript* older = script->older;
+        free(script->source);
+        free(script);
+        script = older;
+    }
+    free(cache->buckets);
+    free(cache);
+}
+
+static void unlinkScript(ScriptCache* cache, CachedScript* script) {
+    if (script->newer != NULL) {
+        script->newer->older = script->older;
+    }
+    else {
+        cache->newest = script->older;
+    }
+    if (script->older != NULL) {
+        script->older->newer = script->newer;
+    }
+    else {
+        cache->oldest = script->newer;
+    }
+}
+
+static void pushNewest(ScriptCache* cache, CachedScript* script) {
+    script->newer = NULL;
+    script->older = cache->newest;
+    if (cache->newest != NULL) {
+        cache->newest->newer = script;
+    }
+    else {
+        cache->oldest = script;
+    }
+    cache->newest = script;
+}
+
+static void evictOldest(ScriptCache* cache) {
+    CachedScript* script = cache->oldest;
+    unlinkScript(cache, script);
+    CachedScript** link = &cache->buckets[script->hash & (cache->bucketCount - 1)];
+    while (*link != script) {
+        link = &(*link)->chain;
+    }
+    *link = script->chain;
+    free(script->source);
+    free(script);
+    cache->count--;
+}
+
+// Whether compiling added a module's marker to the globals past from,
+// i.e. the script runs that module's top-level code.
+static bool linkedModule(Globals* globals, int from) {
+    for (int i = from; i < globals->count; i++) {
+        if (strncmp(globals->names[i], "#module ", 8) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the compiled script for source, compiling and caching it on a
+// miss. Scripts that fail to compile are not cached, so their errors are
+// reported every time. Nor are scripts that linked a module: a hit would
+// run its top level again, where a fresh compile sees it already included.
+// NULL after a compile error.
+ObjFunction* compileCached(VM* vm, ScriptCache* cache, const char* source, size_t length) {
+    uint64_t hash = hashSource(source, length);
+    CachedScript** bucket = &cache->buckets[hash & (cache->bucketCount - 1)];
+    for (CachedScript* script = *bucket; script != NULL; script = script->chain) {
+        if (script->hash == hash && script->length == length &&
+            memcmp(script->source, source, length) == 0) {
+            unlinkScript(cache, script);
+            pushNewest(cache, script);
+            return script->function;
+        }
+    }
+    int globalCount = vm->globals->count;
+    ObjFunction* function = compile(source, vm->globals, vm->symbols, vm->modules);
+    if (function == NULL || cache->capacity == 0 ||
+        linkedModule(vm->globals, globalCount)) {
+        return function;
+    }
+    if (cache->count == cache->capacity) {
+        evictOldest(cache);
+    }
+    CachedScript* script = malloc(sizeof(CachedScript));
+    script->hash = hash;
+    script->length = length;
+    script->source = malloc(length);
+    memcpy(script->source, source, length);
+    script->function = function;
+    script->chain = *bucket;
+    *bucket = script;
+    pushNewest(cache, script);
+    cache->count++;
+    return function;
+}
+
+static bool readFully(int fd, void* buffer, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t count = read(fd, (char*)buffer + done, size - done);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        done += count;
+    }
+    return true;
+}
+
+static bool writeFully(int fd, const void* buffer, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t count = write(fd, (const char*)buffer + done, size - done);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        done += count;
+    }
+    return true;
+}
+
+static void encodeLength(uint8_t* header, uint32_t length) {
+    header[0] = (length >> 24) & 0xff;
+    header[1] = (length >> 16) & 0xff;
+    header[2] = (length >> 8) & 0xff;
+    header[3] = length & 0xff;
+}
+
+// Evaluates requests on one stream until it closes. A request is a 4-byte
+// big-endian length followed by that much source; the response is a
+// 4-byte big-endian length followed by an InterpretResult status byte and,
+// on success, the script's result as text. Diagnostics go to stderr as
+// usual. Returns false if the stream breaks mid-request.
+bool serveRequests(VM* vm, ScriptCache* cache, int in, int out) {
+    for (;;) {
+        uint8_t header[4];
+        ssize_t first;
+        do {
+            first = read(in, header, 1);
+        } while (first < 0 && errno == EINTR);
+        if (first == 0) {
+            return true;
+        }
+        if (first < 0 || !readFully(in, header + 1, 3)) {
+            return false;
+        }
+        uint32_t length = ((uint32_t)header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+        if (length > REQUEST_MAX) {
+            fprintf(stderr, "Request of %u bytes is too long.\n", length);
+            return false;
+        }
+        char* source = malloc(length + 1);
+        if (!readFully(in, source, length)) {
+            free(source);
+            return false;
+        }
+        source[length] = '\0';
+
+        char* response = NULL;
+        size_t responseLength = 0;
+        FILE* body = open_memstream(&response, &responseLength);
+        ObjFunction* function = compileCached(vm, cache, source, length);
+        free(source);
+        if (function == NULL) {
+            fputc(INTERPRET_COMPILE_ERROR, body);
+        }
+        else {
+            Value result;
+            InterpretResult status = execute(vm, function, &result);
+            fputc(status, body);
+            if (status == INTERPRET_OK) {
+                writeValue(body, result);
+            }
+        }
+        fclose(body);
+        encodeLength(header, (uint32_t)responseLength);
+        bool sent = writeFully(out, header, 4) && writeFully(out, response, responseLength);
+        free(response);
+        if (!sent) {
+            return false;
+        }
+    }
+}
+
+// Serves connections one after another, each until its client closes it.
+// Only returns if the socket can't be set up.
+bool serveSocket(VM* vm, ScriptCache* cache, const char* path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long.\n", path);
+        return false;
+    }
+    strcpy(address.sun_path, path);
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0) {
+        fprintf(stderr, "Could not create socket: %s.\n", strerror(errno));
+        return false;
+    }
+    unlink(path);
+    if (bind(server, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(server, 16) < 0) {
+        fprintf(stderr, "Could not listen on %s: %s.\n", path, strerror(errno));
+        close(server);
+        return false;
+    }
+    for (;;) {
+        int client = accept(server, NULL, NULL);
+        if (client < 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "Could not accept connection: %s.\n", strerror(errno));
+            }
+            continue;
+        }
+        serveRequests(vm, cache, client, client);
+        close(client);
+    }
+}
+
+// Runs the VM as a resident server, on the Unix socket at path or, if
+// path is NULL, on stdin and stdout. In the latter case stdout is pointed
+// at stderr for the duration, so stray output can't corrupt responses.
+bool serve(VM* vm, const char* path) {
+    signal(SIGPIPE, SIG_IGN);
+    ScriptCache* cache = initScriptCache(SCRIPT_CACHE_SIZE);
+    bool served;
+    if (path != NULL) {
+        served = serveSocket(vm, cache, path);
+    }
+    else {
+        fflush(stdout);
+        int out = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        served = serveRequests(vm, cache, STDIN_FILENO, out);
+        close(out);
+    }
+    freeScriptCache(cache);
+    return served;
+}
+
+#endif
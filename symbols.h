@@ -0,0 +1,62 @@
+#ifndef symbols_h
+#define symbols_h
+
+#include <string.h>
+#include "common.h"
+#include "memory.h"
+
+#define SYMBOLS_MAX (UINT16_MAX + 1)
+
+// Field names are interned once at compile time, so shapes and inline
+// caches compare small integers rather than strings.
+struct Symbols_ {
+    int count;
+    int capacity;
+    char** names;
+};
+typedef struct Symbols_ Symbols;
+
+Symbols* initSymbols();
+int internSymbol(Symbols* symbols, const char* name, int length);
+void freeSymbols(Symbols* symbols);
+
+Symbols* initSymbols() {
+    Symbols* symbols = malloc(sizeof(Symbols));
+    symbols->count = 0;
+    symbols->capacity = 0;
+    symbols->names = NULL;
+    return symbols;
+}
+
+int internSymbol(Symbols* symbols, const char* name, int length) {
+    for (int i = 0; i < symbols->count; i++) {
+        if ((int)strlen(symbols->names[i]) == length &&
+            memcmp(symbols->names[i], name, length) == 0) {
+            return i;
+        }
+    }
+    if (symbols->count == SYMBOLS_MAX) {
+        return -1;
+    }
+    if (symbols->capacity < symbols->count + 1) {
+        int oldCapacity = symbols->capacity;
+        symbols->capacity = grow_capacity(oldCapacity);
+        symbols->names = grow_array(symbols->names, char*, oldCapacity,
+                symbols->capacity);
+    }
+    char* copy = malloc(length + 1);
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    symbols->names[symbols->count] = copy;
+    return symbols->count++;
+}
+
+void freeSymbols(Symbols* symbols) {
+    for (int i = 0; i < symbols->count; i++) {
+        free(symbols->names[i]);
+    }
+    free_array(char*, symbols->names, symbols->capacity);
+    free(symbols);
+}
+
+#endif
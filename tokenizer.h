@@ -77,6 +77,7 @@ Token* number(Tokenizer* tokenizer);
 bool isAlpha(char c);
 TokenType checkKeyword(Tokenizer* tokenizer, int start, int length, const char* remainder, TokenType type);
 TokenType identifierType(Tokenizer* tokenizer);
+bool skipBlock(Tokenizer* tokenizer);
 
 Tokenizer* initTokenizer(const char* source) {
     Tokenizer* tokenizer = malloc(sizeof(Tokenizer));
@@ -150,6 +151,7 @@ void skipWhitespace(Tokenizer* tokenizer) {
                 while (peek(tokenizer) != '\n' && !isAtEnd(tokenizer)) {
                     advance(tokenizer);
                 }
+                break;
             }
             default:
                 return;
@@ -229,7 +231,7 @@ TokenType identifierType(Tokenizer* tokenizer) {
                         if (tokenizer->current - tokenizer->start > 2) {
                             switch(tokenizer->start[2]) {
                                 case 'i': return checkKeyword(tokenizer, 3, 1, "f", TOKEN_ELIF);
-                                case 's': return checkKeyword(tokenizer, 3, 1, "s", TOKEN_ELSE);
+                                case 's': return checkKeyword(tokenizer, 3, 1, "e", TOKEN_ELSE);
                             }
                         }
                         break;
@@ -252,7 +254,8 @@ TokenType identifierType(Tokenizer* tokenizer) {
         case 'f': {
             if (tokenizer->current - tokenizer->start > 1) {
                 switch(tokenizer->start[1]) {
-                    case 'n': return TOKEN_FN;
+                    case 'a': return checkKeyword(tokenizer, 2, 3, "lse", TOKEN_BOOLEAN);
+                    case 'n': return checkKeyword(tokenizer, 2, 0, "", TOKEN_FN);
                     case 'o': return checkKeyword(tokenizer, 2, 1, "r", TOKEN_FOR);
                     case 'r': return checkKeyword(tokenizer, 2, 2, "ee", TOKEN_FREE);
                 }
@@ -263,7 +266,7 @@ TokenType identifierType(Tokenizer* tokenizer) {
         case 'i': {
             if (tokenizer->current - tokenizer->start > 1) {
                 switch(tokenizer->start[1]) {
-                    case 'f': return TOKEN_IF;
+                    case 'f': return checkKeyword(tokenizer, 2, 0, "", TOKEN_IF);
                     case 'n': return checkKeyword(tokenizer, 2, 5, "clude", TOKEN_INCLUDE);
                 }
             }
@@ -326,7 +329,15 @@ TokenType identifierType(Tokenizer* tokenizer) {
             if (tokenizer->current - tokenizer->start > 1) {
                 switch (tokenizer->start[1]) {
                     case 'h': return checkKeyword(tokenizer, 2, 2, "is", TOKEN_THIS);
-                    case 'r': return checkKeyword(tokenizer, 2, 1, "y", TOKEN_TRY);
+                    case 'r': {
+                        if (tokenizer->current - tokenizer->start > 2) {
+                            switch (tokenizer->start[2]) {
+                                case 'u': return checkKeyword(tokenizer, 3, 1, "e", TOKEN_BOOLEAN);
+                                case 'y': return checkKeyword(tokenizer, 3, 0, "", TOKEN_TRY);
+                            }
+                        }
+                        break;
+                    }
             }
             break;
         }                
@@ -367,8 +378,12 @@ Token* scanToken(Tokenizer* tokenizer) {
         case ']': return makeToken(tokenizer, TOKEN_RIGHT_SQ);
         case '{': return makeToken(tokenizer, TOKEN_LEFT_CURLY);
         case '}': return makeToken(tokenizer, TOKEN_RIGHT_CURLY);
-        case '+': return makeToken(tokenizer, TOKEN_PLUS);
-        case '-': return makeToken(tokenizer, match(tokenizer, '>') ? TOKEN_PERFORM : TOKEN_MINUS);
+        case '+': return makeToken(tokenizer, match(tokenizer, '+') ? TOKEN_INCR : TOKEN_PLUS);
+        case '-':
+            if (match(tokenizer, '>')) {
+                return makeToken(tokenizer, TOKEN_PERFORM);
+            }
+            return makeToken(tokenizer, match(tokenizer, '-') ? TOKEN_DECR : TOKEN_MINUS);
         case '*': return makeToken(tokenizer, TOKEN_STAR);
         case '/': return makeToken(tokenizer, TOKEN_SLASH);
         case ',': return makeToken(tokenizer, TOKEN_COMMA);
@@ -387,4 +402,46 @@ Token* scanToken(Tokenizer* tokenizer) {
     return errorToken(tokenizer, "Unexpected character.");
 }
 
-#endif 
\ No newline at end of file
+// Skips the rest of a block whose opening '{' has just been scanned by
+// matching braces, without producing tokens. Strings and comments are
+// stepped over so braces inside them don't count. Returns false if the
+// source ends before the block does.
+bool skipBlock(Tokenizer* tokenizer) {
+    int depth = 1;
+    while (!isAtEnd(tokenizer)) {
+        char c = advance(tokenizer);
+        switch (c) {
+            case '\n':
+                tokenizer->line++;
+                break;
+            case '#':
+                while (peek(tokenizer) != '\n' && !isAtEnd(tokenizer)) {
+                    advance(tokenizer);
+                }
+                break;
+            case '"':
+            case '\'':
+                while (peek(tokenizer) != c && !isAtEnd(tokenizer)) {
+                    if (peek(tokenizer) == '\n') {
+                        tokenizer->line++;
+                    }
+                    advance(tokenizer);
+                }
+                if (!isAtEnd(tokenizer)) {
+                    advance(tokenizer);
+                }
+                break;
+            case '{':
+                depth++;
+                break;
+            case '}':
+                if (--depth == 0) {
+                    return true;
+                }
+                break;
+        }
+    }
+    return false;
+}
+
+#endif
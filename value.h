@@ -6,7 +6,51 @@
 #include "memory.h"
 #include "common.h"
 
-typedef double Value;
+typedef struct Obj_ Obj;
+
+enum ValueType_ {
+    VAL_NIL,
+    VAL_BOOL,
+    VAL_NUMBER,
+    VAL_OBJ,
+    VAL_UNDEFINED
+};
+typedef enum ValueType_ ValueType;
+
+struct Value_ {
+    ValueType type;
+    union {
+        bool boolean;
+        double number;
+        Obj* obj;
+    } as;
+};
+typedef struct Value_ Value;
+
+// What the compiler can prove about a value from declared types. Values
+// known to be STATIC_REAL may use the untagged OP_*_REAL instructions.
+enum StaticType_ {
+    STATIC_ANY,
+    STATIC_REAL
+};
+typedef enum StaticType_ StaticType;
+
+#define IS_NIL(value) ((value).type == VAL_NIL)
+#define IS_BOOL(value) ((value).type == VAL_BOOL)
+#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_OBJ(value) ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
+
+#define AS_BOOL(value) ((value).as.boolean)
+#define AS_NUMBER(value) ((value).as.number)
+#define AS_OBJ(value) ((value).as.obj)
+
+#define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
+#define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = (value)}})
+#define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = (value)}})
+#define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj*)(object)}})
+// Sentinel held by global slots that have been resolved but never assigned.
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {.number = 0}})
 
 struct ValueArray_ {
     int capacity;
@@ -19,6 +63,10 @@ ValueArray* initValueArray();
 void writeValueArray(ValueArray* array, Value value);
 void freeValueArray(ValueArray* array);
 void printValue(Value value);
+void writeValue(FILE* file, Value value);
+bool valuesEqual(Value a, Value b);
+void writeObject(FILE* file, Value value);
+bool objectsEqual(Value a, Value b);
 
 ValueArray* initValueArray() {
     ValueArray* array = malloc(sizeof(ValueArray));
@@ -41,12 +89,34 @@ void writeValueArray(ValueArray* array, Value value) {
 
 void freeValueArray(ValueArray* array) {
     free_array(Value, array->values, array->capacity);
-    array = initValueArray();
+    free(array);
 }
 
 void printValue(Value value) {
-    printf("%g", value);
+    writeValue(stdout, value);
+}
+
+void writeValue(FILE* file, Value value) {
+    switch (value.type) {
+        case VAL_NIL: fprintf(file, "nil"); break;
+        case VAL_BOOL: fprintf(file, AS_BOOL(value) ? "true" : "false"); break;
+        case VAL_NUMBER: fprintf(file, "%g", AS_NUMBER(value)); break;
+        case VAL_OBJ: writeObject(file, value); break;
+        case VAL_UNDEFINED: fprintf(file, "undefined"); break;
+    }
 }
 
+bool valuesEqual(Value a, Value b) {
+    if (a.type != b.type) {
+        return false;
+    }
+    switch (a.type) {
+        case VAL_NIL: return true;
+        case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
+        case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
+        case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b) || objectsEqual(a, b);
+        default: return false;
+    }
+}
 
 #endif
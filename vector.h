@@ -0,0 +1,450 @@
+#ifndef vector_h
+#define vector_h
+
+#include <limits.h>
+#include <string.h>
+#include "common.h"
+#include "chunk.h"
+#include "value.h"
+#include "object.h"
+#include "globals.h"
+
+// Vector arithmetic and reductions run as one loop per vector, in SSE2 or,
+// where the CPU has it, AVX2. -DNO_SIMD leaves the loops to the compiler.
+#if defined(__x86_64__) && !defined(NO_SIMD)
+#define VECTOR_SIMD
+#include <immintrin.h>
+#endif
+
+// Longest vector fill() makes.
+#define VECTOR_MAX (INT_MAX / (int)sizeof(double))
+
+// An element-wise kernel writes count results to out. Each operand is
+// either a whole vector or a single number broadcast over it; the shapes
+// are VV, VS and SV, in that order in each row of a kernel table.
+typedef void (*VectorKernel)(double* out, const double* a, const double* b, int count);
+
+// A reduction over count elements of a, or of a and b for dot.
+typedef double (*ReduceKernel)(const double* a, const double* b, int count);
+
+enum VectorShape_ {
+    SHAPE_VV,
+    SHAPE_VS,
+    SHAPE_SV
+};
+typedef enum VectorShape_ VectorShape;
+
+enum Reduction_ {
+    REDUCE_SUM,
+    REDUCE_MIN,
+    REDUCE_MAX,
+    REDUCE_DOT
+};
+typedef enum Reduction_ Reduction;
+
+void selectVectorKernels();
+const char* vectorArithmetic(uint8_t op, Value a, Value b, Value* result);
+Value negateVector(ObjVector* vector);
+void defineNatives(Globals* globals);
+
+#define ELEMENT_V(p, i) (p)[i]
+#define ELEMENT_S(p, i) (p)[0]
+
+#define SCALAR_KERNEL(name, op, A, B) \
+    static void name(double* out, const double* a, const double* b, int count) { \
+        for (int i = 0; i < count; i++) { \
+            out[i] = ELEMENT_##A(a, i) op ELEMENT_##B(b, i); \
+        } \
+    }
+
+#define SCALAR_KERNELS(name, op) \
+    SCALAR_KERNEL(name##VVScalar, op, V, V) \
+    SCALAR_KERNEL(name##VSScalar, op, V, S) \
+    SCALAR_KERNEL(name##SVScalar, op, S, V)
+
+SCALAR_KERNELS(add, +)
+SCALAR_KERNELS(sub, -)
+SCALAR_KERNELS(mult, *)
+SCALAR_KERNELS(div, /)
+
+#define KERNEL_ROW(name, isa) {name##VV##isa, name##VS##isa, name##SV##isa}
+
+static VectorKernel scalarKernels[4][3] = {
+    KERNEL_ROW(add, Scalar),
+    KERNEL_ROW(sub, Scalar),
+    KERNEL_ROW(mult, Scalar),
+    KERNEL_ROW(div, Scalar)
+};
+
+static double sumScalar(const double* a, const double* b, int count) {
+    double sum = 0;
+    for (int i = 0; i < count; i++) {
+        sum += a[i];
+    }
+    return sum;
+}
+
+static double minScalar(const double* a, const double* b, int count) {
+    double min = a[0];
+    for (int i = 1; i < count; i++) {
+        min = a[i] < min ? a[i] : min;
+    }
+    return min;
+}
+
+static double maxScalar(const double* a, const double* b, int count) {
+    double max = a[0];
+    for (int i = 1; i < count; i++) {
+        max = a[i] > max ? a[i] : max;
+    }
+    return max;
+}
+
+static double dotScalar(const double* a, const double* b, int count) {
+    double sum = 0;
+    for (int i = 0; i < count; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+static ReduceKernel scalarReductions[4] = {sumScalar, minScalar, maxScalar, dotScalar};
+
+#ifdef VECTOR_SIMD
+
+// SSE2 is part of x86-64, so these need no check before use. Loads are
+// unaligned; the tail that doesn't fill a register is done one by one.
+#define LOAD128_V(p, i) _mm_loadu_pd((p) + (i))
+#define LOAD128_S(p, i) _mm_set1_pd((p)[0])
+
+#define SSE2_KERNEL(name, op, intrinsic, A, B) \
+    static void name(double* out, const double* a, const double* b, int count) { \
+        int i = 0; \
+        for (; i + 2 <= count; i += 2) { \
+            _mm_storeu_pd(out + i, intrinsic(LOAD128_##A(a, i), LOAD128_##B(b, i))); \
+        } \
+        for (; i < count; i++) { \
+            out[i] = ELEMENT_##A(a, i) op ELEMENT_##B(b, i); \
+        } \
+    }
+
+#define SSE2_KERNELS(name, op, intrinsic) \
+    SSE2_KERNEL(name##VVSSE2, op, intrinsic, V, V) \
+    SSE2_KERNEL(name##VSSSE2, op, intrinsic, V, S) \
+    SSE2_KERNEL(name##SVSSE2, op, intrinsic, S, V)
+
+SSE2_KERNELS(add, +, _mm_add_pd)
+SSE2_KERNELS(sub, -, _mm_sub_pd)
+SSE2_KERNELS(mult, *, _mm_mul_pd)
+SSE2_KERNELS(div, /, _mm_div_pd)
+
+static VectorKernel sse2Kernels[4][3] = {
+    KERNEL_ROW(add, SSE2),
+    KERNEL_ROW(sub, SSE2),
+    KERNEL_ROW(mult, SSE2),
+    KERNEL_ROW(div, SSE2)
+};
+
+// Sums keep one partial sum per lane, so they may differ in the last bits
+// from adding the elements left to right.
+static double sumSSE2(const double* a, const double* b, int count) {
+    __m128d sum = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        sum = _mm_add_pd(sum, _mm_loadu_pd(a + i));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, sum);
+    double total = lanes[0] + lanes[1];
+    for (; i < count; i++) {
+        total += a[i];
+    }
+    return total;
+}
+
+static double dotSSE2(const double* a, const double* b, int count) {
+    __m128d sum = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        sum = _mm_add_pd(sum, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, sum);
+    double total = lanes[0] + lanes[1];
+    for (; i < count; i++) {
+        total += a[i] * b[i];
+    }
+    return total;
+}
+
+// min and max start every lane at the first element, so lanes never hold
+// a value that isn't in the vector.
+#define SSE2_EXTREME(name, intrinsic, op) \
+    static double name(const double* a, const double* b, int count) { \
+        __m128d extreme = _mm_set1_pd(a[0]); \
+        int i = 0; \
+        for (; i + 2 <= count; i += 2) { \
+            extreme = intrinsic(_mm_loadu_pd(a + i), extreme); \
+        } \
+        double lanes[2]; \
+        _mm_storeu_pd(lanes, extreme); \
+        double result = lanes[1] op lanes[0] ? lanes[1] : lanes[0]; \
+        for (; i < count; i++) { \
+            result = a[i] op result ? a[i] : result; \
+        } \
+        return result; \
+    }
+
+SSE2_EXTREME(minSSE2, _mm_min_pd, <)
+SSE2_EXTREME(maxSSE2, _mm_max_pd, >)
+
+static ReduceKernel sse2Reductions[4] = {sumSSE2, minSSE2, maxSSE2, dotSSE2};
+
+// The AVX2 versions are compiled for that target alone and only called
+// once the CPU has been found to support it.
+#define AVX2 __attribute__((target("avx2")))
+#define LOAD256_V(p, i) _mm256_loadu_pd((p) + (i))
+#define LOAD256_S(p, i) _mm256_set1_pd((p)[0])
+
+#define AVX2_KERNEL(name, op, intrinsic, A, B) \
+    AVX2 static void name(double* out, const double* a, const double* b, int count) { \
+        int i = 0; \
+        for (; i + 4 <= count; i += 4) { \
+            _mm256_storeu_pd(out + i, intrinsic(LOAD256_##A(a, i), LOAD256_##B(b, i))); \
+        } \
+        for (; i < count; i++) { \
+            out[i] = ELEMENT_##A(a, i) op ELEMENT_##B(b, i); \
+        } \
+    }
+
+#define AVX2_KERNELS(name, op, intrinsic) \
+    AVX2_KERNEL(name##VVAVX2, op, intrinsic, V, V) \
+    AVX2_KERNEL(name##VSAVX2, op, intrinsic, V, S) \
+    AVX2_KERNEL(name##SVAVX2, op, intrinsic, S, V)
+
+AVX2_KERNELS(add, +, _mm256_add_pd)
+AVX2_KERNELS(sub, -, _mm256_sub_pd)
+AVX2_KERNELS(mult, *, _mm256_mul_pd)
+AVX2_KERNELS(div, /, _mm256_div_pd)
+
+static VectorKernel avx2Kernels[4][3] = {
+    KERNEL_ROW(add, AVX2),
+    KERNEL_ROW(sub, AVX2),
+    KERNEL_ROW(mult, AVX2),
+    KERNEL_ROW(div, AVX2)
+};
+
+AVX2 static double reduceLanes256(__m256d sum) {
+    double lanes[4];
+    _mm256_storeu_pd(lanes, sum);
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+// Two accumulators, so consecutive adds don't wait on each other.
+AVX2 static double sumAVX2(const double* a, const double* b, int count) {
+    __m256d first = _mm256_setzero_pd();
+    __m256d second = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        first = _mm256_add_pd(first, _mm256_loadu_pd(a + i));
+        second = _mm256_add_pd(second, _mm256_loadu_pd(a + i + 4));
+    }
+    double total = reduceLanes256(_mm256_add_pd(first, second));
+    for (; i < count; i++) {
+        total += a[i];
+    }
+    return total;
+}
+
+AVX2 static double dotAVX2(const double* a, const double* b, int count) {
+    __m256d first = _mm256_setzero_pd();
+    __m256d second = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        first = _mm256_add_pd(first, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        second = _mm256_add_pd(second,
+                _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+    double total = reduceLanes256(_mm256_add_pd(first, second));
+    for (; i < count; i++) {
+        total += a[i] * b[i];
+    }
+    return total;
+}
+
+#define AVX2_EXTREME(name, intrinsic, op) \
+    AVX2 static double name(const double* a, const double* b, int count) { \
+        __m256d extreme = _mm256_set1_pd(a[0]); \
+        int i = 0; \
+        for (; i + 4 <= count; i += 4) { \
+            extreme = intrinsic(_mm256_loadu_pd(a + i), extreme); \
+        } \
+        double lanes[4]; \
+        _mm256_storeu_pd(lanes, extreme); \
+        double result = lanes[0]; \
+        for (int lane = 1; lane < 4; lane++) { \
+            result = lanes[lane] op result ? lanes[lane] : result; \
+        } \
+        for (; i < count; i++) { \
+            result = a[i] op result ? a[i] : result; \
+        } \
+        return result; \
+    }
+
+AVX2_EXTREME(minAVX2, _mm256_min_pd, <)
+AVX2_EXTREME(maxAVX2, _mm256_max_pd, >)
+
+static ReduceKernel avx2Reductions[4] = {sumAVX2, minAVX2, maxAVX2, dotAVX2};
+
+#endif
+
+// Rows are indexed by the instruction less OP_ADD.
+static VectorKernel (*vectorKernels)[3] = scalarKernels;
+static ReduceKernel* reduceKernels = scalarReductions;
+
+// Picks the widest kernels the CPU runs. Called once, before any script.
+void selectVectorKernels() {
+#ifdef VECTOR_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        vectorKernels = avx2Kernels;
+        reduceKernels = avx2Reductions;
+    }
+    else {
+        vectorKernels = sse2Kernels;
+        reduceKernels = sse2Reductions;
+    }
+#endif
+}
+
+// OP_ADD to OP_DIV with at least one vector operand: element-wise with a
+// vector of the same length, or with a number applied to every element.
+// The result is a new vector.
+const char* vectorArithmetic(uint8_t op, Value a, Value b, Value* result) {
+    double left = IS_NUMBER(a) ? AS_NUMBER(a) : 0;
+    double right = IS_NUMBER(b) ? AS_NUMBER(b) : 0;
+    const double* x = &left;
+    const double* y = &right;
+    int count;
+    VectorShape shape;
+    if (IS_VECTOR(a) && IS_VECTOR(b)) {
+        if (AS_VECTOR(a)->count != AS_VECTOR(b)->count) {
+            return "Vectors must have the same length.";
+        }
+        x = AS_VECTOR(a)->elements;
+        y = AS_VECTOR(b)->elements;
+        count = AS_VECTOR(a)->count;
+        shape = SHAPE_VV;
+    }
+    else if (IS_VECTOR(a) && IS_NUMBER(b)) {
+        x = AS_VECTOR(a)->elements;
+        count = AS_VECTOR(a)->count;
+        shape = SHAPE_VS;
+    }
+    else if (IS_NUMBER(a) && IS_VECTOR(b)) {
+        y = AS_VECTOR(b)->elements;
+        count = AS_VECTOR(b)->count;
+        shape = SHAPE_SV;
+    }
+    else {
+        return "Operands must be numbers or vectors.";
+    }
+    ObjVector* vector = newVector(count);
+    vectorKernels[op - OP_ADD][shape](vector->elements, x, y, count);
+    *result = OBJ_VAL(vector);
+    return NULL;
+}
+
+// Subtracting from -0 rather than 0 keeps the sign of zero elements.
+Value negateVector(ObjVector* vector) {
+    double zero = -0.0;
+    ObjVector* negated = newVector(vector->count);
+    vectorKernels[OP_SUB - OP_ADD][SHAPE_SV](negated->elements, &zero, vector->elements, vector->count);
+    return OBJ_VAL(negated);
+}
+
+static const char* lenNative(Value* args, Value* result) {
+    if (!IS_VECTOR(args[0])) {
+        return "len() takes a vector.";
+    }
+    *result = NUMBER_VAL(AS_VECTOR(args[0])->count);
+    return NULL;
+}
+
+static const char* sumNative(Value* args, Value* result) {
+    if (!IS_VECTOR(args[0])) {
+        return "sum() takes a vector.";
+    }
+    ObjVector* vector = AS_VECTOR(args[0]);
+    *result = NUMBER_VAL(reduceKernels[REDUCE_SUM](vector->elements, NULL, vector->count));
+    return NULL;
+}
+
+static const char* minNative(Value* args, Value* result) {
+    if (!IS_VECTOR(args[0]) || AS_VECTOR(args[0])->count == 0) {
+        return "min() takes a non-empty vector.";
+    }
+    ObjVector* vector = AS_VECTOR(args[0]);
+    *result = NUMBER_VAL(reduceKernels[REDUCE_MIN](vector->elements, NULL, vector->count));
+    return NULL;
+}
+
+static const char* maxNative(Value* args, Value* result) {
+    if (!IS_VECTOR(args[0]) || AS_VECTOR(args[0])->count == 0) {
+        return "max() takes a non-empty vector.";
+    }
+    ObjVector* vector = AS_VECTOR(args[0]);
+    *result = NUMBER_VAL(reduceKernels[REDUCE_MAX](vector->elements, NULL, vector->count));
+    return NULL;
+}
+
+static const char* dotNative(Value* args, Value* result) {
+    if (!IS_VECTOR(args[0]) || !IS_VECTOR(args[1])) {
+        return "dot() takes two vectors.";
+    }
+    ObjVector* a = AS_VECTOR(args[0]);
+    ObjVector* b = AS_VECTOR(args[1]);
+    if (a->count != b->count) {
+        return "Vectors must have the same length.";
+    }
+    *result = NUMBER_VAL(reduceKernels[REDUCE_DOT](a->elements, b->elements, a->count));
+    return NULL;
+}
+
+// fill(n, x) makes a vector of n copies of x.
+static const char* fillNative(Value* args, Value* result) {
+    if (!IS_NUMBER(args[0]) || !IS_NUMBER(args[1])) {
+        return "fill() takes a length and a number.";
+    }
+    double length = AS_NUMBER(args[0]);
+    if (!(length >= 0 && length <= VECTOR_MAX) || length != (double)(int)length) {
+        return "Vector length must be a whole number in range.";
+    }
+    ObjVector* vector = newVector((int)length);
+    for (int i = 0; i < vector->count; i++) {
+        vector->elements[i] = AS_NUMBER(args[1]);
+    }
+    *result = OBJ_VAL(vector);
+    return NULL;
+}
+
+static void defineNative(Globals* globals, const char* name, int arity, NativeFn function) {
+    int length = (int)strlen(name);
+    int slot = findGlobal(globals, name, length);
+    if (slot == -1) {
+        slot = addGlobal(globals, name, length);
+    }
+    globals->values[slot] = OBJ_VAL(newNative(name, arity, function));
+}
+
+// The built-ins are ordinary globals, so scripts may assign over them.
+void defineNatives(Globals* globals) {
+    defineNative(globals, "len", 1, lenNative);
+    defineNative(globals, "sum", 1, sumNative);
+    defineNative(globals, "min", 1, minNative);
+    defineNative(globals, "max", 1, maxNative);
+    defineNative(globals, "dot", 2, dotNative);
+    defineNative(globals, "fill", 2, fillNative);
+}
+
+#endif
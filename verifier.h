@@ -0,0 +1,367 @@
+#ifndef verifier_h
+#define verifier_h
+
+#include <stdlib.h>
+#include "common.h"
+#include "chunk.h"
+#include "object.h"
+#include "globals.h"
+#include "symbols.h"
+
+// Everything run() trusts about a chunk is checked here, once, before the
+// chunk first runs: every instruction decodes within the code, operands
+// name existing constants, globals, locals, caches, tables and loops,
+// jumps and table targets land on instruction starts, the stack never
+// underflows and has the same depth wherever paths meet, and no path runs
+// off the end without returning. Exception handlers are entered with the
+// depth their table entry records plus the error, and the code a handler
+// covers must never have fewer slots than that. The deepest the stack gets, counted from
+// the frame's callee slot, is recorded in maxStack so calls can check for
+// overflow once per frame instead of once per push.
+const char* verifyChunk(Chunk* chunk, int arity, int globalCount, int symbolCount, int* where);
+const char* verifyFunction(ObjFunction* function, Globals* globals, Symbols* symbols, int* where);
+
+static bool isBinaryOperator(uint8_t op) {
+    switch (op) {
+        case OP_ADD: case OP_SUB: case OP_MULT: case OP_DIV:
+        case OP_LESS: case OP_GREATER: case OP_EQUAL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Queues the successor at target with the given stack depth, or reports
+// why it can't be one.
+static const char* reachOffset(Chunk* chunk, bool* starts, int* depths, int* pending,
+        int* pendingCount, int target, int depth) {
+    if (target < 0 || target >= chunk->count) {
+        return target == chunk->count ? "Execution runs off the end of the chunk." :
+            "Jump target out of range.";
+    }
+    if (!starts[target]) {
+        return "Jump into the middle of an instruction.";
+    }
+    if (depths[target] == -1) {
+        depths[target] = depth;
+        pending[(*pendingCount)++] = target;
+        return NULL;
+    }
+    return depths[target] == depth ? NULL : "Inconsistent stack depth where paths meet.";
+}
+
+const char* verifyChunk(Chunk* chunk, int arity, int globalCount, int symbolCount, int* where) {
+    *where = 0;
+    if (chunk->count == 0) {
+        return "Empty chunk.";
+    }
+    bool* starts = calloc(chunk->count, sizeof(bool));
+    int* depths = malloc(sizeof(int) * chunk->count);
+    int* pending = malloc(sizeof(int) * chunk->count);
+    int pendingCount = 0;
+    const char* error = NULL;
+    for (int offset = 0; offset < chunk->count && error == NULL;
+            offset += instructionSize(chunk->code[offset])) {
+        starts[offset] = true;
+        depths[offset] = -1;
+        *where = offset;
+        if (offset + instructionSize(chunk->code[offset]) > chunk->count) {
+            error = "Instruction operands run past the end of the chunk.";
+        }
+    }
+    for (int i = 0; i < chunk->cacheCount && error == NULL; i++) {
+        if (chunk->caches[i].symbol >= symbolCount) {
+            error = "Inline cache names an unknown field symbol.";
+        }
+    }
+    for (int i = 0; i < chunk->tableCount && error == NULL; i++) {
+        JumpTable* table = &chunk->tables[i];
+        if (table->count < 0 || (table->count > 0 && table->targets == NULL)) {
+            error = "Malformed match table.";
+        }
+    }
+    if (error == NULL) {
+        depths[0] = arity + 1;
+        pending[pendingCount++] = 0;
+    }
+    int maxStack = arity + 1;
+    for (int i = 0; i < chunk->handlerCount && error == NULL; i++) {
+        Handler* handler = &chunk->handlers[i];
+        *where = handler->target;
+        if (handler->start < 0 || handler->start > handler->end || handler->end > chunk->count ||
+            (handler->start < chunk->count && !starts[handler->start])) {
+            error = "Malformed exception handler range.";
+        }
+        else if (handler->depth < arity + 1) {
+            error = "Exception handler depth below the frame's arguments.";
+        }
+        else {
+            // The handler is entered with the error pushed above its depth.
+            error = reachOffset(chunk, starts, depths, pending, &pendingCount,
+                    handler->target, handler->depth + 1);
+            if (handler->depth + 1 > maxStack) {
+                maxStack = handler->depth + 1;
+            }
+        }
+    }
+    bool optimized = chunk->baseline != NULL;
+    while (pendingCount > 0 && error == NULL) {
+        int offset = pending[--pendingCount];
+        uint8_t* code = &chunk->code[offset];
+        int depth = depths[offset];
+        int size = instructionSize(code[0]);
+        int a = size >= 3 ? (code[1] << 8) | code[2] : (size == 2 ? code[1] : 0);
+        int pops = 0;
+        int pushes = 0;
+        int local = -1;
+        int otherLocal = -1;
+        int target = -1;
+        bool fallsThrough = true;
+        *where = offset;
+        if (!optimized && code[0] >= OP_BINARY_LL && code[0] <= OP_JUMP_BACK) {
+            error = "Optimized instruction in a baseline chunk.";
+            break;
+        }
+        switch (code[0]) {
+            case OP_RETURN:
+                pops = 1;
+                fallsThrough = false;
+                break;
+            case OP_NEGATE:
+            case OP_NEGATE_REAL:
+            case OP_NOT:
+            case OP_GUARD_REAL:
+                pops = 1;
+                pushes = 1;
+                break;
+            case OP_ADD: case OP_SUB: case OP_MULT: case OP_DIV:
+            case OP_EQUAL: case OP_GREATER: case OP_LESS:
+            case OP_ADD_REAL: case OP_SUB_REAL: case OP_MULT_REAL: case OP_DIV_REAL:
+            case OP_LESS_REAL: case OP_GREATER_REAL: case OP_EQUAL_REAL:
+                pops = 2;
+                pushes = 1;
+                break;
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG:
+                if (a >= chunk->constants->count) {
+                    error = "Constant index out of range.";
+                }
+                pushes = 1;
+                break;
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                pushes = 1;
+                break;
+            case OP_POP:
+                pops = 1;
+                break;
+            case OP_GET_GLOBAL:
+                if (a >= globalCount) {
+                    error = "Global slot out of range.";
+                }
+                pushes = 1;
+                break;
+            case OP_SET_GLOBAL:
+            case OP_SET_GLOBAL_POP:
+                if (a >= globalCount) {
+                    error = "Global slot out of range.";
+                }
+                pops = 1;
+                pushes = code[0] == OP_SET_GLOBAL ? 1 : 0;
+                break;
+            case OP_GET_LOCAL:
+                local = a;
+                pushes = 1;
+                break;
+            case OP_SET_LOCAL:
+            case OP_SET_LOCAL_POP:
+                local = a;
+                pops = 1;
+                pushes = code[0] == OP_SET_LOCAL ? 1 : 0;
+                break;
+            case OP_INCR_LOCAL:
+                local = code[1];
+                break;
+            case OP_JUMP:
+                target = offset + 3 + a;
+                fallsThrough = false;
+                break;
+            case OP_JUMP_IF_FALSE:
+                pops = 1;
+                pushes = 1;
+                target = offset + 3 + a;
+                break;
+            case OP_JUMP_IF_FALSE_POP:
+                pops = 1;
+                target = offset + 3 + a;
+                break;
+            case OP_LESS_JUMP_IF_FALSE:
+                pops = 2;
+                target = offset + 3 + a;
+                break;
+            case OP_LOOP:
+            case OP_LOOP_LT: {
+                int operand = code[0] == OP_LOOP ? 1 : 3;
+                int loop = (code[operand + 2] << 8) | code[operand + 3];
+                target = offset + size - ((code[operand] << 8) | code[operand + 1]);
+                fallsThrough = code[0] == OP_LOOP_LT;
+                if (code[0] == OP_LOOP_LT) {
+                    local = code[1];
+                    otherLocal = code[2];
+                }
+                if (loop >= chunk->loopCount) {
+                    error = "Loop counter index out of range.";
+                }
+                break;
+            }
+            case OP_JUMP_BACK:
+                target = offset + 3 - a;
+                fallsThrough = false;
+                break;
+            case OP_THROW:
+                pops = 1;
+                fallsThrough = false;
+                break;
+            case OP_VECTOR:
+                pops = a;
+                pushes = 1;
+                break;
+            case OP_GET_INDEX:
+                pops = 2;
+                pushes = 1;
+                break;
+            case OP_SET_INDEX:
+                pops = 3;
+                pushes = 1;
+                break;
+            case OP_CALL:
+                pops = a + 1;
+                pushes = 1;
+                break;
+            case OP_TAIL_CALL:
+                pops = a + 1;
+                fallsThrough = false;
+                break;
+            case OP_GET_FIELD:
+            case OP_SET_FIELD:
+                if (a >= chunk->cacheCount) {
+                    error = "Inline cache index out of range.";
+                }
+                pops = code[0] == OP_GET_FIELD ? 1 : 2;
+                pushes = 1;
+                break;
+            case OP_JUMP_TABLE:
+            case OP_JUMP_SEARCH:
+            case OP_JUMP_LINEAR:
+                if (a >= chunk->tableCount) {
+                    error = "Match table index out of range.";
+                    break;
+                }
+                if (code[0] != OP_JUMP_TABLE && chunk->tables[a].count > 0 &&
+                    chunk->tables[a].keys == NULL) {
+                    error = "Match table has no keys.";
+                    break;
+                }
+                pops = 1;
+                fallsThrough = false;
+                break;
+            case OP_BINARY_LL:
+            case OP_BINARY_LK:
+            case OP_BINARY_GG:
+            case OP_BINARY_GK: {
+                if (!isBinaryOperator(code[1])) {
+                    error = "Unknown operator in fused instruction.";
+                    break;
+                }
+                bool global = code[0] == OP_BINARY_GG || code[0] == OP_BINARY_GK;
+                int first = global ? (code[2] << 8) | code[3] : code[2];
+                int second = code[0] == OP_BINARY_LL ? code[3] : (code[size - 2] << 8) | code[size - 1];
+                if (global && first >= globalCount) {
+                    error = "Global slot out of range.";
+                }
+                else if (!global) {
+                    local = first;
+                }
+                if (code[0] == OP_BINARY_LL) {
+                    otherLocal = second;
+                }
+                else if (code[0] == OP_BINARY_GG && second >= globalCount) {
+                    error = "Global slot out of range.";
+                }
+                else if ((code[0] == OP_BINARY_LK || code[0] == OP_BINARY_GK) &&
+                         second >= chunk->constants->count) {
+                    error = "Constant index out of range.";
+                }
+                pushes = 1;
+                break;
+            }
+            default:
+                error = "Unknown opcode.";
+                break;
+        }
+        if (error != NULL) {
+            break;
+        }
+        if ((local != -1 && local >= depth) || (otherLocal != -1 && otherLocal >= depth)) {
+            error = "Local slot out of range.";
+            break;
+        }
+        if (pops > depth) {
+            error = "Stack underflow.";
+            break;
+        }
+        int after = depth - pops + pushes;
+        if (after > maxStack) {
+            maxStack = after;
+        }
+        if (fallsThrough) {
+            error = reachOffset(chunk, starts, depths, pending, &pendingCount, offset + size, after);
+        }
+        if (error == NULL && target != -1) {
+            error = reachOffset(chunk, starts, depths, pending, &pendingCount, target, after);
+        }
+        if (error == NULL && (code[0] == OP_JUMP_TABLE || code[0] == OP_JUMP_SEARCH ||
+                              code[0] == OP_JUMP_LINEAR)) {
+            JumpTable* table = &chunk->tables[a];
+            for (int i = 0; i < table->count && error == NULL; i++) {
+                error = reachOffset(chunk, starts, depths, pending, &pendingCount,
+                        table->targets[i], after);
+            }
+            if (error == NULL) {
+                error = reachOffset(chunk, starts, depths, pending, &pendingCount,
+                        table->defaultTarget, after);
+            }
+        }
+    }
+    for (int i = 0; i < chunk->handlerCount && error == NULL; i++) {
+        Handler* handler = &chunk->handlers[i];
+        for (int offset = handler->start; offset < handler->end; offset++) {
+            if (starts[offset] && depths[offset] != -1 && depths[offset] < handler->depth) {
+                *where = offset;
+                error = "Stack below the exception handler's depth inside its range.";
+                break;
+            }
+        }
+    }
+    free(starts);
+    free(depths);
+    free(pending);
+    if (error == NULL) {
+        chunk->maxStack = maxStack;
+        chunk->verified = true;
+    }
+    return error;
+}
+
+// Verifies a compiled function's chunk unless that was done already.
+const char* verifyFunction(ObjFunction* function, Globals* globals, Symbols* symbols, int* where) {
+    Chunk* chunk = function->chunk;
+    *where = 0;
+    if (chunk->verified) {
+        return NULL;
+    }
+    return verifyChunk(chunk, function->arity, globals->count, symbols->count, where);
+}
+
+#endif
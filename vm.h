@@ -1,20 +1,49 @@
 #ifndef vm_h
 #define vm_h
 
+#include <limits.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include "common.h"
 #include "chunk.h"
 #include "debug.h"
 #include "value.h"
+#include "object.h"
+#include "globals.h"
+#include "symbols.h"
+#include "modules.h"
 #include "compiler.h"
+#include "optimizer.h"
+#include "verifier.h"
+#include "vector.h"
 
-#define STACK_MAX 256
+#define FRAMES_MAX 256
+#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+
+// Frames are preallocated on the VM; a call only claims the next entry.
+// The ip of the running frame lives in vm->ip, and is saved into its frame
+// while a callee runs. chunk is the tier the frame is executing, which
+// on-stack replacement and deoptimization switch mid-call.
+struct CallFrame_ {
+    ObjFunction* function;
+    Chunk* chunk;
+    uint8_t* ip;
+    Value* slots;
+};
+typedef struct CallFrame_ CallFrame;
 
 struct VM_ {
+    CallFrame frames[FRAMES_MAX];
+    int frameCount;
     Chunk* chunk;
     uint8_t* ip;
     Value stack[STACK_MAX];
     Value* stackTop;
+    Globals* globals;
+    Symbols* symbols;
+    ModuleCache* modules;
+    bool caught;
+    bool compileFailed;
 };
 typedef struct VM_ VM;
 
@@ -27,17 +56,28 @@ typedef enum InterpretResult_ InterpretResult;
 
 void resetStack(VM* vm) {
     vm->stackTop = vm->stack;
+    vm->frameCount = 0;
 }
 
 VM* initVM() {
     VM* vm = malloc(sizeof(VM));
     vm->chunk = NULL;
     vm->ip = NULL;
+    vm->caught = false;
+    vm->compileFailed = false;
+    vm->globals = initGlobals();
+    vm->symbols = initSymbols();
+    vm->modules = initModuleCache();
+    selectVectorKernels();
+    defineNatives(vm->globals);
     resetStack(vm);
     return vm;
 }
 
 void freeVM(VM* vm) {
+    freeGlobals(vm->globals);
+    freeSymbols(vm->symbols);
+    freeModuleCache(vm->modules);
     free(vm);
 }
 
@@ -51,15 +91,439 @@ Value pop(VM* vm) {
     return *vm->stackTop;
 }
 
-InterpretResult run(VM* vm) {
+Value peekStack(VM* vm, int distance) {
+    return vm->stackTop[-1 - distance];
+}
+
+// Whether any of the first frameCount frames is in the given chunk.
+static bool chunkInUse(VM* vm, Chunk* chunk, int frameCount) {
+    for (int i = 0; i < frameCount; i++) {
+        if (vm->frames[i].chunk == chunk) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Called once a frame has left chunk, with frameCount frames still below
+// it, and after vm->chunk has moved on so the profiler can't sample it. An
+// optimized chunk that deoptimization dropped is freed once no frame is
+// left in it; freeChunk leaves the constants and caches it shares with the
+// baseline alone.
+static void releaseChunk(VM* vm, Chunk* chunk, int frameCount) {
+    if (chunk->baseline != NULL && chunk->baseline->optimized != chunk &&
+        !chunkInUse(vm, chunk, frameCount)) {
+        freeChunk(chunk);
+    }
+}
+
+// Errors are caught by searching the exception tables of the frames'
+// chunks, innermost frame first, at the instruction each frame is at. The
+// table is only read here, so try blocks cost nothing until something is
+// raised. Returns the handler and its frame's index, or NULL if nothing
+// catches the error.
+static Handler* findHandler(VM* vm, int* frameIndex) {
+    for (int i = vm->frameCount - 1; i >= 0; i--) {
+        CallFrame* frame = &vm->frames[i];
+        uint8_t* ip = i == vm->frameCount - 1 ? vm->ip : frame->ip;
+        int offset = (int)(ip - frame->chunk->code - 1);
+        for (int j = 0; j < frame->chunk->handlerCount; j++) {
+            Handler* handler = &frame->chunk->handlers[j];
+            if (offset >= handler->start && offset < handler->end) {
+                *frameIndex = i;
+                return handler;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Drops the frames above the handler's and resumes at the handler with
+// the error on the stack.
+static void unwind(VM* vm, int frameIndex, Handler* handler, Value error) {
+    CallFrame* frame = &vm->frames[frameIndex];
+    int frameCount = vm->frameCount;
+    vm->frameCount = frameIndex + 1;
+    vm->stackTop = frame->slots + handler->depth;
+    push(vm, error);
+    vm->chunk = frame->chunk;
+    vm->ip = frame->chunk->code + handler->target;
+    for (int i = frameCount - 1; i > frameIndex; i--) {
+        releaseChunk(vm, vm->frames[i].chunk, i);
+    }
+}
+
+static void printStackTrace(VM* vm) {
+    for (int i = vm->frameCount - 1; i >= 0; i--) {
+        CallFrame* frame = &vm->frames[i];
+        ObjFunction* function = frame->function;
+        uint8_t* ip = i == vm->frameCount - 1 ? vm->ip : frame->ip;
+        size_t instruction = ip - frame->chunk->code - 1;
+        fprintf(stderr, "[line %d] in ", frame->chunk->lines[instruction]);
+        if (function->name == NULL) {
+            fprintf(stderr, "script\n");
+        }
+        else {
+            fprintf(stderr, "%s()\n", function->name);
+        }
+    }
+}
+
+// Raises an error with the formatted message. Inside a try block the
+// message becomes the caught value, and caught tells run() to resume at
+// the handler; otherwise it is reported with a stack trace.
+void runtimeError(VM* vm, const char* format, ...) {
+    char message[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    int frameIndex;
+    Handler* handler = findHandler(vm, &frameIndex);
+    if (handler != NULL) {
+        unwind(vm, frameIndex, handler, OBJ_VAL(copyString(message, (int)strlen(message))));
+        vm->caught = true;
+        return;
+    }
+    fprintf(stderr, "%s\n", message);
+    printStackTrace(vm);
+    resetStack(vm);
+}
+
+bool isFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Compiles a skimmed function on its first call and verifies its chunk,
+// then checks the arguments against its arity and declared parameter types.
+// A body that fails to compile has had its errors reported by the compiler;
+// it stops the program as a compile error, which no handler can catch.
+bool checkArguments(VM* vm, ObjFunction* function, int argCount) {
+    if (function->chunk == NULL &&
+        !compileLazyFunction(function, vm->globals, vm->symbols, vm->modules)) {
+        vm->compileFailed = true;
+        resetStack(vm);
+        return false;
+    }
+    if (!function->chunk->verified) {
+        int where;
+        const char* error = verifyFunction(function, vm->globals, vm->symbols, &where);
+        if (error != NULL) {
+            runtimeError(vm, "Invalid bytecode in %s() at offset %d: %s", function->name, where, error);
+            return false;
+        }
+    }
+    if (argCount != function->arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.", function->arity, argCount);
+        return false;
+    }
+    if (function->paramTypes != NULL) {
+        Value* args = vm->stackTop - argCount;
+        for (int i = 0; i < argCount; i++) {
+            if (function->paramTypes[i] == STATIC_REAL && !IS_NUMBER(args[i])) {
+                runtimeError(vm, "Argument %d to %s() must be a real.", i + 1, function->name);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// run() doesn't check for overflow as it pushes; instead a frame is only
+// entered if the deepest stack its chunk can reach fits.
+bool callFunction(VM* vm, ObjFunction* function, int argCount) {
+    if (!checkArguments(vm, function, argCount)) {
+        return false;
+    }
+    if (vm->frameCount == FRAMES_MAX ||
+        vm->stackTop - argCount - 1 + function->chunk->maxStack > vm->stack + STACK_MAX) {
+        runtimeError(vm, "Stack overflow.");
+        return false;
+    }
+    if (vm->frameCount > 0) {
+        vm->frames[vm->frameCount - 1].ip = vm->ip;
+    }
+    CallFrame* frame = &vm->frames[vm->frameCount++];
+    frame->function = function;
+    frame->chunk = function->chunk->optimized != NULL ? function->chunk->optimized : function->chunk;
+    frame->slots = vm->stackTop - argCount - 1;
+    vm->chunk = frame->chunk;
+    vm->ip = frame->chunk->code;
+    return true;
+}
+
+// Calling a struct constructs an instance, filling fields in declaration
+// order from the arguments.
+bool constructInstance(VM* vm, ObjStruct* shape, int argCount) {
+    if (argCount > shape->fieldCount) {
+        runtimeError(vm, "Expected at most %d arguments but got %d.", shape->fieldCount, argCount);
+        return false;
+    }
+    ObjInstance* instance = newInstance(shape);
+    Value* args = vm->stackTop - argCount;
+    for (int i = 0; i < argCount; i++) {
+        instance->fields[i] = args[i];
+    }
+    vm->stackTop -= argCount + 1;
+    push(vm, OBJ_VAL(instance));
+    return true;
+}
+
+// Natives run to completion without a frame; the result replaces the
+// callee and arguments.
+bool callNative(VM* vm, ObjNative* native, int argCount) {
+    if (argCount != native->arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.", native->arity, argCount);
+        return false;
+    }
+    Value result;
+    const char* error = native->function(vm->stackTop - argCount, &result);
+    if (error != NULL) {
+        runtimeError(vm, "%s", error);
+        return false;
+    }
+    vm->stackTop -= argCount + 1;
+    push(vm, result);
+    return true;
+}
+
+bool callValue(VM* vm, Value callee, int argCount) {
+    if (IS_FUNCTION(callee)) {
+        return callFunction(vm, AS_FUNCTION(callee), argCount);
+    }
+    if (IS_STRUCT(callee)) {
+        return constructInstance(vm, AS_STRUCT(callee), argCount);
+    }
+    if (IS_NATIVE(callee)) {
+        return callNative(vm, AS_NATIVE(callee), argCount);
+    }
+    runtimeError(vm, "Can only call functions.");
+    return false;
+}
+
+// Replaces the running frame with a call to the callee on top of the stack:
+// the callee and its arguments slide down over the frame's slots.
+bool tailCallValue(VM* vm, Value callee, int argCount) {
+    if (!IS_FUNCTION(callee)) {
+        runtimeError(vm, "Can only call functions.");
+        return false;
+    }
+    ObjFunction* function = AS_FUNCTION(callee);
+    if (!checkArguments(vm, function, argCount)) {
+        return false;
+    }
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    if (frame->slots + function->chunk->maxStack > vm->stack + STACK_MAX) {
+        runtimeError(vm, "Stack overflow.");
+        return false;
+    }
+    memmove(frame->slots, vm->stackTop - argCount - 1, (argCount + 1) * sizeof(Value));
+    vm->stackTop = frame->slots + argCount + 1;
+    Chunk* left = frame->chunk;
+    frame->function = function;
+    frame->chunk = function->chunk->optimized != NULL ? function->chunk->optimized : function->chunk;
+    vm->chunk = frame->chunk;
+    vm->ip = frame->chunk->code;
+    releaseChunk(vm, left, vm->frameCount);
+    return true;
+}
+
+// Returns the field index for the site's symbol in the given shape. A hit
+// is a pointer compare per cached shape; a miss falls back to scanning the
+// shape and records the result while the cache has room.
+static inline int lookupField(InlineCache* cache, ObjStruct* shape) {
+#ifndef NO_INLINE_CACHE
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->shapes[i] == shape) {
+            return cache->indexes[i];
+        }
+    }
+#endif
+    int field = findField(shape, cache->symbol);
+#ifndef NO_INLINE_CACHE
+    if (field != -1 && cache->count < INLINE_CACHE_WAYS) {
+        cache->shapes[cache->count] = shape;
+        cache->indexes[cache->count] = field;
+        cache->count++;
+    }
+#endif
+    return field;
+}
+
+// Frames entered the baseline chunk having checked its stack bound, so the
+// optimized chunk must not need more.
+static bool verifyOptimized(VM* vm, Chunk* baseline) {
+    int where;
+    ObjFunction* function = vm->frames[vm->frameCount - 1].function;
+    const char* error = verifyChunk(baseline->optimized, function->arity,
+            vm->globals->count, vm->symbols->count, &where);
+    return error == NULL && baseline->optimized->maxStack <= baseline->maxStack;
+}
+
+// Called when a loop in the running baseline chunk gets hot: optimizes the
+// chunk unless that was done already, and moves the frame into the
+// optimized code at the loop header it has just jumped back to. Counted
+// loops keep counting in optimized code, where getting hot does nothing.
+void onStackReplace(VM* vm, CallFrame* frame, Loop* loop) {
+    Chunk* baseline = vm->chunk;
+    if (baseline->baseline != NULL) {
+        loop->hotness = INT_MIN;
+        return;
+    }
+    if (baseline->optimized == NULL && baseline->deopts < DEOPT_LIMIT) {
+        baseline->optimized = optimizeChunk(baseline);
+        if (baseline->optimized != NULL && !verifyOptimized(vm, baseline)) {
+            // Never retry an optimization the verifier rejected. It never
+            // ran, so nothing refers to it.
+            freeChunk(baseline->optimized);
+            baseline->optimized = NULL;
+            baseline->deopts = DEOPT_LIMIT;
+        }
+    }
+    Chunk* optimized = baseline->optimized;
+    if (optimized == NULL) {
+        // Stay in the baseline tier and stop checking for a long while.
+        loop->hotness = INT_MIN;
+        return;
+    }
+    vm->ip = optimized->code + optimized->entries[vm->ip - baseline->code];
+    vm->chunk = optimized;
+    frame->chunk = optimized;
+}
+
+// A speculation in the optimized chunk failed at the given instruction.
+// The frame resumes in the baseline chunk at the instruction it stood for,
+// which redoes the work generically. The optimized chunk is dropped and
+// the loops warm up again, so the chunk is reoptimized without
+// speculating at that site. The dropped chunk is freed now unless a
+// caller's frame will still return into it.
+void deoptimize(VM* vm, CallFrame* frame, uint8_t* instruction) {
+    Chunk* optimized = vm->chunk;
+    Chunk* baseline = optimized->baseline;
+    int offset = optimized->resume[instruction - optimized->code];
+    baseline->unstable[offset] = true;
+    if (baseline->optimized == optimized) {
+        baseline->optimized = NULL;
+        baseline->deopts++;
+        for (int i = 0; i < baseline->loopCount; i++) {
+            baseline->loops[i].hotness = 0;
+        }
+    }
+    vm->ip = baseline->code + offset;
+    vm->chunk = baseline;
+    frame->chunk = baseline;
+    releaseChunk(vm, optimized, vm->frameCount - 1);
+}
+
+static inline Value binaryNumbers(uint8_t op, double a, double b) {
+    switch (op) {
+        case OP_ADD: return NUMBER_VAL(a + b);
+        case OP_SUB: return NUMBER_VAL(a - b);
+        case OP_MULT: return NUMBER_VAL(a * b);
+        case OP_DIV: return NUMBER_VAL(a / b);
+        case OP_LESS: return BOOL_VAL(a < b);
+        case OP_GREATER: return BOOL_VAL(a > b);
+        default: return BOOL_VAL(a == b);
+    }
+}
+
+// Pops the running frame, leaving the value on top of the stack as the
+// result of its call. Returns true once the outermost frame has returned;
+// the result is then left on the stack for execute().
+static inline bool returnFromFrame(VM* vm) {
+    Value result = pop(vm);
+    vm->frameCount--;
+    Chunk* left = vm->frames[vm->frameCount].chunk;
+    if (vm->frameCount == 0) {
+        pop(vm);
+        push(vm, result);
+        releaseChunk(vm, left, 0);
+        return true;
+    }
+    vm->stackTop = vm->frames[vm->frameCount].slots;
+    push(vm, result);
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    vm->chunk = frame->chunk;
+    vm->ip = frame->ip;
+    releaseChunk(vm, left, vm->frameCount);
+    return false;
+}
+
+// Arithmetic where an operand isn't a number. Vectors are handled a whole
+// vector at a time; anything else is an error.
+static bool vectorOperands(VM* vm, uint8_t op) {
+    Value b = peekStack(vm, 0);
+    Value a = peekStack(vm, 1);
+    if (!IS_VECTOR(a) && !IS_VECTOR(b)) {
+        runtimeError(vm, "Operands must be numbers.");
+        return false;
+    }
+    Value result;
+    const char* error = vectorArithmetic(op, a, b, &result);
+    if (error != NULL) {
+        runtimeError(vm, "%s", error);
+        return false;
+    }
+    vm->stackTop -= 2;
+    push(vm, result);
+    return true;
+}
+
+// The element a vector index selects, or NULL after reporting why there
+// is none.
+static double* vectorElement(VM* vm, Value vector, Value index) {
+    if (!IS_VECTOR(vector)) {
+        runtimeError(vm, "Only vectors can be indexed.");
+        return NULL;
+    }
+    if (!IS_NUMBER(index)) {
+        runtimeError(vm, "Vector index must be a number.");
+        return NULL;
+    }
+    double position = AS_NUMBER(index);
+    if (!(position >= 0 && position < AS_VECTOR(vector)->count) || position != (double)(int)position) {
+        runtimeError(vm, "Vector index out of range.");
+        return NULL;
+    }
+    return &AS_VECTOR(vector)->elements[(int)position];
+}
+
+static InterpretResult dispatch(VM* vm) {
     #define READ_BYTE() (*vm->ip++)
+    #define READ_SHORT() (vm->ip += 2, (uint16_t)((vm->ip[-2] << 8) | vm->ip[-1]))
     #define READ_CONSTANT() (vm->chunk->constants->values[READ_BYTE()])
-    #define BINARY_OP(op) \
+    // The _REAL instructions are only emitted when the compiler has proven
+    // both operands are numbers, so they operate on the payload directly.
+    #define REAL_OP(valueType, op) \
+        do { \
+            double b = vm->stackTop[-1].as.number; \
+            vm->stackTop--; \
+            vm->stackTop[-1] = valueType(vm->stackTop[-1].as.number op b); \
+        } while (false)
+    // Numbers are handled inline; other operands take the slow path, which
+    // is where vector arithmetic dispatches.
+    #define ARITHMETIC_OP(op, instruction) \
         do { \
-            double b = pop(vm); \
-            double a = pop(vm); \
-            push(vm, a op b); \
+            if (IS_NUMBER(peekStack(vm, 0)) && IS_NUMBER(peekStack(vm, 1))) { \
+                double b = AS_NUMBER(pop(vm)); \
+                double a = AS_NUMBER(pop(vm)); \
+                push(vm, NUMBER_VAL(a op b)); \
+            } \
+            else if (!vectorOperands(vm, instruction)) { \
+                return INTERPRET_RUNTIME_ERROR; \
+            } \
         } while (false)
+    #define BINARY_OP(valueType, op) \
+        do { \
+            if (!IS_NUMBER(peekStack(vm, 0)) || !IS_NUMBER(peekStack(vm, 1))) { \
+                runtimeError(vm, "Operands must be numbers."); \
+                return INTERPRET_RUNTIME_ERROR; \
+            } \
+            double b = AS_NUMBER(pop(vm)); \
+            double a = AS_NUMBER(pop(vm)); \
+            push(vm, valueType(a op b)); \
+        } while (false)
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
     for (;;) {
         #ifdef DEBUG_TRACE_EXECUTION
             printf("          ");
@@ -73,44 +537,457 @@ InterpretResult run(VM* vm) {
         #endif
         uint8_t instruction;
         switch (instruction = READ_BYTE()) {
-            case OP_RETURN:
-                printValue(pop(vm));
-                printf("\n");
-                return INTERPRET_OK;
+            case OP_RETURN: {
+                if (returnFromFrame(vm)) {
+                    return INTERPRET_OK;
+                }
+                frame = &vm->frames[vm->frameCount - 1];
+                break;
+            }
             case OP_CONSTANT: {
                 Value constant = READ_CONSTANT();
                 push(vm, constant);
                 break;
             }
+            case OP_CONSTANT_LONG: {
+                Value constant = vm->chunk->constants->values[READ_SHORT()];
+                push(vm, constant);
+                break;
+            }
             case OP_NEGATE: {
-                push(vm, -pop(vm));
+                if (IS_VECTOR(peekStack(vm, 0))) {
+                    vm->stackTop[-1] = negateVector(AS_VECTOR(peekStack(vm, 0)));
+                    break;
+                }
+                if (!IS_NUMBER(peekStack(vm, 0))) {
+                    runtimeError(vm, "Operand must be a number.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
+                break;
+            }
+            case OP_ADD: ARITHMETIC_OP(+, OP_ADD); break;
+            case OP_SUB: ARITHMETIC_OP(-, OP_SUB); break;
+            case OP_MULT: ARITHMETIC_OP(*, OP_MULT); break;
+            case OP_DIV: ARITHMETIC_OP(/, OP_DIV); break;
+            case OP_NIL: push(vm, NIL_VAL); break;
+            case OP_POP: pop(vm); break;
+            case OP_GET_GLOBAL: {
+                uint16_t slot = READ_SHORT();
+                Value value = vm->globals->values[slot];
+                if (IS_UNDEFINED(value)) {
+                    runtimeError(vm, "Undefined variable '%s'.", vm->globals->names[slot]);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                push(vm, value);
+                break;
+            }
+            case OP_SET_GLOBAL: {
+                uint16_t slot = READ_SHORT();
+                vm->globals->values[slot] = peekStack(vm, 0);
+                break;
+            }
+            case OP_TRUE: push(vm, BOOL_VAL(true)); break;
+            case OP_FALSE: push(vm, BOOL_VAL(false)); break;
+            case OP_EQUAL: {
+                Value b = pop(vm);
+                Value a = pop(vm);
+                push(vm, BOOL_VAL(valuesEqual(a, b)));
+                break;
+            }
+            case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
+            case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
+            case OP_NOT: push(vm, BOOL_VAL(isFalsey(pop(vm)))); break;
+            case OP_GET_LOCAL: {
+                uint8_t slot = READ_BYTE();
+                push(vm, frame->slots[slot]);
+                break;
+            }
+            case OP_SET_LOCAL: {
+                uint8_t slot = READ_BYTE();
+                frame->slots[slot] = peekStack(vm, 0);
+                break;
+            }
+            case OP_JUMP: {
+                uint16_t offset = READ_SHORT();
+                vm->ip += offset;
+                break;
+            }
+            case OP_JUMP_IF_FALSE: {
+                uint16_t offset = READ_SHORT();
+                if (isFalsey(peekStack(vm, 0))) {
+                    vm->ip += offset;
+                }
+                break;
+            }
+            case OP_LOOP: {
+                uint16_t offset = READ_SHORT();
+                Loop* loop = &vm->chunk->loops[READ_SHORT()];
+                vm->ip -= offset;
+#ifndef NO_OSR
+                if (++loop->hotness == HOT_LOOP_THRESHOLD) {
+                    onStackReplace(vm, frame, loop);
+                }
+#endif
+                break;
+            }
+            case OP_CALL: {
+                int argCount = READ_BYTE();
+                if (!callValue(vm, peekStack(vm, argCount), argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                frame = &vm->frames[vm->frameCount - 1];
+                break;
+            }
+            case OP_TAIL_CALL: {
+                int argCount = READ_BYTE();
+                Value callee = peekStack(vm, argCount);
+                if (IS_FUNCTION(callee)) {
+                    if (!tailCallValue(vm, callee, argCount)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    break;
+                }
+                // Natives and constructors have no frame to reuse; their
+                // result is returned as soon as they produce it.
+                if (!callValue(vm, callee, argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (returnFromFrame(vm)) {
+                    return INTERPRET_OK;
+                }
+                frame = &vm->frames[vm->frameCount - 1];
+                break;
+            }
+            case OP_GET_FIELD: {
+                InlineCache* cache = &vm->chunk->caches[READ_SHORT()];
+                if (!IS_INSTANCE(peekStack(vm, 0))) {
+                    runtimeError(vm, "Only struct instances have fields.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                ObjInstance* instance = AS_INSTANCE(peekStack(vm, 0));
+                int field = lookupField(cache, instance->shape);
+                if (field == -1) {
+                    runtimeError(vm, "Undefined field '%s'.", vm->symbols->names[cache->symbol]);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                vm->stackTop[-1] = instance->fields[field];
+                break;
+            }
+            case OP_SET_FIELD: {
+                InlineCache* cache = &vm->chunk->caches[READ_SHORT()];
+                if (!IS_INSTANCE(peekStack(vm, 1))) {
+                    runtimeError(vm, "Only struct instances have fields.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                ObjInstance* instance = AS_INSTANCE(peekStack(vm, 1));
+                int field = lookupField(cache, instance->shape);
+                if (field == -1) {
+                    runtimeError(vm, "Undefined field '%s'.", vm->symbols->names[cache->symbol]);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                Value value = pop(vm);
+                instance->fields[field] = value;
+                vm->stackTop[-1] = value;
+                break;
+            }
+            case OP_JUMP_TABLE: {
+                JumpTable* table = &vm->chunk->tables[READ_SHORT()];
+                Value subject = pop(vm);
+                int target = table->defaultTarget;
+                if (IS_NUMBER(subject)) {
+                    double index = AS_NUMBER(subject) - table->min;
+                    if (index >= 0 && index < table->count && index == (double)(int)index) {
+                        target = table->targets[(int)index];
+                    }
+                }
+                vm->ip = vm->chunk->code + target;
+                break;
+            }
+            case OP_JUMP_SEARCH: {
+                JumpTable* table = &vm->chunk->tables[READ_SHORT()];
+                Value subject = pop(vm);
+                int target = table->defaultTarget;
+                // NaN is unordered against every key, so it must not reach
+                // the search, which takes "neither less nor greater" as a hit.
+                if (IS_NUMBER(subject) && AS_NUMBER(subject) == AS_NUMBER(subject)) {
+                    double key = AS_NUMBER(subject);
+                    int low = 0;
+                    int high = table->count - 1;
+                    while (low <= high) {
+                        int mid = (low + high) / 2;
+                        double candidate = AS_NUMBER(table->keys[mid]);
+                        if (candidate < key) {
+                            low = mid + 1;
+                        }
+                        else if (candidate > key) {
+                            high = mid - 1;
+                        }
+                        else {
+                            target = table->targets[mid];
+                            break;
+                        }
+                    }
+                }
+                vm->ip = vm->chunk->code + target;
+                break;
+            }
+            case OP_ADD_REAL: REAL_OP(NUMBER_VAL, +); break;
+            case OP_SUB_REAL: REAL_OP(NUMBER_VAL, -); break;
+            case OP_MULT_REAL: REAL_OP(NUMBER_VAL, *); break;
+            case OP_DIV_REAL: REAL_OP(NUMBER_VAL, /); break;
+            case OP_LESS_REAL: REAL_OP(BOOL_VAL, <); break;
+            case OP_GREATER_REAL: REAL_OP(BOOL_VAL, >); break;
+            case OP_EQUAL_REAL: REAL_OP(BOOL_VAL, ==); break;
+            case OP_NEGATE_REAL: {
+                vm->stackTop[-1].as.number = -vm->stackTop[-1].as.number;
+                break;
+            }
+            case OP_GUARD_REAL: {
+                if (!IS_NUMBER(peekStack(vm, 0))) {
+                    runtimeError(vm, "Expected a real value.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case OP_INCR_LOCAL: {
+                Value* slot = &frame->slots[READ_BYTE()];
+                int8_t delta = (int8_t)READ_BYTE();
+                if (!IS_NUMBER(*slot)) {
+                    runtimeError(vm, "Operand must be a number.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                *slot = NUMBER_VAL(AS_NUMBER(*slot) + delta);
+                break;
+            }
+            case OP_LESS_JUMP_IF_FALSE: {
+                uint16_t offset = READ_SHORT();
+                Value b = pop(vm);
+                Value a = pop(vm);
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    runtimeError(vm, "Operands must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (!(AS_NUMBER(a) < AS_NUMBER(b))) {
+                    vm->ip += offset;
+                }
+                break;
+            }
+            case OP_LOOP_LT: {
+                Value a = frame->slots[READ_BYTE()];
+                Value b = frame->slots[READ_BYTE()];
+                uint16_t offset = READ_SHORT();
+                Loop* loop = &vm->chunk->loops[READ_SHORT()];
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    runtimeError(vm, "Operands must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (AS_NUMBER(a) < AS_NUMBER(b)) {
+                    vm->ip -= offset;
+#ifndef NO_OSR
+                    if (++loop->hotness == HOT_LOOP_THRESHOLD) {
+                        onStackReplace(vm, frame, loop);
+                    }
+#endif
+                }
+                break;
+            }
+            case OP_VECTOR: {
+                int count = READ_BYTE();
+                Value* elements = vm->stackTop - count;
+                for (int i = 0; i < count; i++) {
+                    if (!IS_NUMBER(elements[i])) {
+                        runtimeError(vm, "Vector elements must be numbers.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                }
+                ObjVector* vector = newVector(count);
+                for (int i = 0; i < count; i++) {
+                    vector->elements[i] = AS_NUMBER(elements[i]);
+                }
+                vm->stackTop = elements;
+                push(vm, OBJ_VAL(vector));
+                break;
+            }
+            case OP_GET_INDEX: {
+                double* element = vectorElement(vm, peekStack(vm, 1), peekStack(vm, 0));
+                if (element == NULL) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                vm->stackTop--;
+                vm->stackTop[-1] = NUMBER_VAL(*element);
+                break;
+            }
+            case OP_SET_INDEX: {
+                double* element = vectorElement(vm, peekStack(vm, 2), peekStack(vm, 1));
+                if (element == NULL) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                Value value = pop(vm);
+                if (!IS_NUMBER(value)) {
+                    runtimeError(vm, "Vector elements must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                *element = AS_NUMBER(value);
+                vm->stackTop -= 2;
+                push(vm, value);
+                break;
+            }
+            case OP_BINARY_LL: {
+                uint8_t* start = vm->ip - 1;
+                uint8_t op = READ_BYTE();
+                Value a = frame->slots[READ_BYTE()];
+                Value b = frame->slots[READ_BYTE()];
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    deoptimize(vm, frame, start);
+                    break;
+                }
+                push(vm, binaryNumbers(op, AS_NUMBER(a), AS_NUMBER(b)));
+                break;
+            }
+            case OP_BINARY_LK: {
+                uint8_t* start = vm->ip - 1;
+                uint8_t op = READ_BYTE();
+                Value a = frame->slots[READ_BYTE()];
+                Value b = vm->chunk->constants->values[READ_SHORT()];
+                if (!IS_NUMBER(a)) {
+                    deoptimize(vm, frame, start);
+                    break;
+                }
+                push(vm, binaryNumbers(op, AS_NUMBER(a), AS_NUMBER(b)));
+                break;
+            }
+            case OP_BINARY_GG: {
+                uint8_t* start = vm->ip - 1;
+                uint8_t op = READ_BYTE();
+                Value a = vm->globals->values[READ_SHORT()];
+                Value b = vm->globals->values[READ_SHORT()];
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    deoptimize(vm, frame, start);
+                    break;
+                }
+                push(vm, binaryNumbers(op, AS_NUMBER(a), AS_NUMBER(b)));
+                break;
+            }
+            case OP_BINARY_GK: {
+                uint8_t* start = vm->ip - 1;
+                uint8_t op = READ_BYTE();
+                Value a = vm->globals->values[READ_SHORT()];
+                Value b = vm->chunk->constants->values[READ_SHORT()];
+                if (!IS_NUMBER(a)) {
+                    deoptimize(vm, frame, start);
+                    break;
+                }
+                push(vm, binaryNumbers(op, AS_NUMBER(a), AS_NUMBER(b)));
+                break;
+            }
+            case OP_SET_LOCAL_POP: {
+                uint8_t slot = READ_BYTE();
+                frame->slots[slot] = pop(vm);
+                break;
+            }
+            case OP_SET_GLOBAL_POP: {
+                uint16_t slot = READ_SHORT();
+                vm->globals->values[slot] = pop(vm);
+                break;
+            }
+            case OP_JUMP_IF_FALSE_POP: {
+                uint16_t offset = READ_SHORT();
+                if (isFalsey(pop(vm))) {
+                    vm->ip += offset;
+                }
+                break;
+            }
+            case OP_JUMP_BACK: {
+                uint16_t offset = READ_SHORT();
+                vm->ip -= offset;
+                break;
+            }
+            case OP_THROW: {
+                Value error = pop(vm);
+                int frameIndex;
+                Handler* handler = findHandler(vm, &frameIndex);
+                if (handler == NULL) {
+                    fputs("Uncaught error: ", stderr);
+                    writeValue(stderr, error);
+                    fputs("\n", stderr);
+                    printStackTrace(vm);
+                    resetStack(vm);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                unwind(vm, frameIndex, handler, error);
+                frame = &vm->frames[vm->frameCount - 1];
+                break;
+            }
+            case OP_JUMP_LINEAR: {
+                JumpTable* table = &vm->chunk->tables[READ_SHORT()];
+                Value subject = pop(vm);
+                int target = table->defaultTarget;
+                for (int i = 0; i < table->count; i++) {
+                    if (valuesEqual(subject, table->keys[i])) {
+                        target = table->targets[i];
+                        break;
+                    }
+                }
+                vm->ip = vm->chunk->code + target;
                 break;
             }
-            case OP_ADD: BINARY_OP(+); break;
-            case OP_SUB: BINARY_OP(-); break;
-            case OP_MULT: BINARY_OP(*); break;
-            case OP_DIV: BINARY_OP(/); break;
         }
     }
     #undef READ_BYTE
+    #undef READ_SHORT
     #undef READ_CONSTANT
+    #undef REAL_OP
+    #undef ARITHMETIC_OP
     #undef BINARY_OP
 }
-    
 
-InterpretResult interpret(VM* vm, const char* source) {
-    Chunk* chunk = initChunk();
-    if (!compile(source, chunk)) {
-        freeChunk(chunk);
+// Every error path in dispatch() returns right after raising, so a caught
+// runtime error resumes by entering dispatch() again at the handler.
+InterpretResult run(VM* vm) {
+    InterpretResult result;
+    while ((result = dispatch(vm)) == INTERPRET_RUNTIME_ERROR && vm->caught) {
+        vm->caught = false;
+    }
+    if (vm->compileFailed) {
+        vm->compileFailed = false;
         return INTERPRET_COMPILE_ERROR;
     }
-    vm->chunk = chunk;
-    vm->ip = vm->chunk->code;
-    
-    InterpretResult result = run(vm);
-    
-    freeChunk(chunk);
     return result;
 }
 
-#endif
\ No newline at end of file
+
+// Runs a compiled script to completion; on success *result is its value.
+InterpretResult execute(VM* vm, ObjFunction* function, Value* result) {
+    int where;
+    const char* error = verifyFunction(function, vm->globals, vm->symbols, &where);
+    if (error != NULL) {
+        fprintf(stderr, "Invalid bytecode in script at offset %d: %s\n", where, error);
+        return INTERPRET_COMPILE_ERROR;
+    }
+    push(vm, OBJ_VAL(function));
+    if (!callFunction(vm, function, 0)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    InterpretResult status = run(vm);
+    if (status == INTERPRET_OK) {
+        *result = pop(vm);
+    }
+    return status;
+}
+
+InterpretResult interpret(VM* vm, const char* source) {
+    ObjFunction* function = compile(source, vm->globals, vm->symbols, vm->modules);
+    if (function == NULL) {
+        return INTERPRET_COMPILE_ERROR;
+    }
+    Value result;
+    InterpretResult status = execute(vm, function, &result);
+    if (status == INTERPRET_OK && !IS_NIL(result)) {
+        printValue(result);
+        printf("\n");
+    }
+    return status;
+}
+
+#endif